@@ -0,0 +1,240 @@
+#pragma once
+
+#include <sensor_msgs/PointCloud2.h>
+#include <sensor_msgs/PointField.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/** Read a value of type T at an unaligned address */
+template <typename T>
+inline T readUnaligned(const uint8_t* data) {
+  T value;
+  std::memcpy(&value, data, sizeof(T));
+  return value;
+}
+
+/** Read a numeric field of the given ``sensor_msgs::PointField`` datatype */
+inline double readField(const uint8_t* data, uint8_t datatype) {
+  switch (datatype) {
+    case sensor_msgs::PointField::INT8:
+      return readUnaligned<int8_t>(data);
+    case sensor_msgs::PointField::UINT8:
+      return readUnaligned<uint8_t>(data);
+    case sensor_msgs::PointField::INT16:
+      return readUnaligned<int16_t>(data);
+    case sensor_msgs::PointField::UINT16:
+      return readUnaligned<uint16_t>(data);
+    case sensor_msgs::PointField::INT32:
+      return readUnaligned<int32_t>(data);
+    case sensor_msgs::PointField::UINT32:
+      return readUnaligned<uint32_t>(data);
+    case sensor_msgs::PointField::FLOAT32:
+      return readUnaligned<float>(data);
+    case sensor_msgs::PointField::FLOAT64:
+      return readUnaligned<double>(data);
+    default:
+      return 0;
+  }
+}
+
+/** ``sensor_msgs::PointField`` datatype of a C++ type */
+template <typename T>
+struct PointFieldType;
+template <>
+struct PointFieldType<uint8_t> {
+  static const uint8_t value = sensor_msgs::PointField::UINT8;
+};
+template <>
+struct PointFieldType<uint16_t> {
+  static const uint8_t value = sensor_msgs::PointField::UINT16;
+};
+template <>
+struct PointFieldType<uint32_t> {
+  static const uint8_t value = sensor_msgs::PointField::UINT32;
+};
+template <>
+struct PointFieldType<float> {
+  static const uint8_t value = sensor_msgs::PointField::FLOAT32;
+};
+template <>
+struct PointFieldType<double> {
+  static const uint8_t value = sensor_msgs::PointField::FLOAT64;
+};
+
+/**
+ * Point layouts of the supported lidar drivers.
+ *
+ * Every driver publishes x/y/z as float32 at offsets 0/4/8; a layout gives the
+ * type and offset of intensity, ring and per-point time, the names of the ring
+ * and time fields, and the unit of time. The time is either relative to the
+ * message stamp or absolute. Supporting another driver only takes another
+ * layout (and a ``SensorType``).
+ */
+struct VelodyneLayout {
+  typedef float IntensityType;
+  typedef uint16_t RingType;
+  typedef float TimeType;
+  static const int intensity = 16;
+  static const int ring      = 20;
+  static const int time      = 24;
+  static const char* ringField() { return "ring"; }
+  static const char* timeField() { return "time"; }
+  static double timeScale() { return 1.0; }
+  static bool absoluteTime() { return false; }
+};
+
+struct OusterLayout {
+  typedef float IntensityType;
+  typedef uint8_t RingType;
+  typedef uint32_t TimeType;
+  static const int intensity = 16;
+  static const int ring      = 26;
+  static const int time      = 20;
+  static const char* ringField() { return "ring"; }
+  static const char* timeField() { return "t"; }
+  static double timeScale() { return 1e-9; }
+  static bool absoluteTime() { return false; }
+};
+
+struct HesaiLayout {
+  typedef float IntensityType;
+  typedef uint16_t RingType;
+  typedef double TimeType;
+  static const int intensity = 16;
+  static const int ring      = 32;
+  static const int time      = 24;
+  static const char* ringField() { return "ring"; }
+  static const char* timeField() { return "timestamp"; }
+  static double timeScale() { return 1.0; }
+  static bool absoluteTime() { return true; }
+};
+
+/** Livox driver point clouds (x, y, z, intensity, tag, line, timestamp) */
+struct LivoxLayout {
+  typedef float IntensityType;
+  typedef uint8_t RingType;
+  typedef double TimeType;
+  static const int intensity = 12;
+  static const int ring      = 17;
+  static const int time      = 18;
+  static const char* ringField() { return "line"; }
+  static const char* timeField() { return "timestamp"; }
+  static double timeScale() { return 1e-9; }
+  static bool absoluteTime() { return true; }
+};
+
+/**
+ * Byte layout of a lidar ``sensor_msgs::PointCloud2`` stream, resolved at runtime.
+ *
+ * The offsets of x/y/z, intensity, ring and the per-point time are resolved
+ * once from the fields of the first message, using the field names and time
+ * unit of the driver layout; points are then read in place from the message
+ * buffer instead of converting the message to a PCL cloud. When the stream
+ * matches the driver layout exactly, ``FixedCloudLayout`` reads the same
+ * points with offsets and types known at compile time.
+ */
+struct CloudLayout {
+  uint32_t pointStep    = 0;
+  int x                 = -1;  // offsets are -1 if the field is missing
+  int y                 = -1;
+  int z                 = -1;
+  int intensity         = -1;
+  int ring              = -1;
+  int time              = -1;
+  uint8_t intensityType = 0;  // sensor_msgs::PointField datatypes
+  uint8_t ringType      = 0;
+  uint8_t timeType      = 0;
+  double timeScale      = 1.0;  // per-point time unit in seconds
+  bool absoluteTime     = false;
+  double timeBase       = 0;  // subtracted from the per-point time, the message stamp for absolute times
+
+  /** Resolve the offsets from the message fields, returns false if x/y/z are not float32 fields */
+  template <typename Layout>
+  bool resolve(const sensor_msgs::PointCloud2& msg) {
+    pointStep = msg.point_step;
+    x = y = z = intensity = ring = time = -1;
+    for (const auto& field : msg.fields) {
+      if (field.name == "x" && field.datatype == sensor_msgs::PointField::FLOAT32) {
+        x = field.offset;
+      } else if (field.name == "y" && field.datatype == sensor_msgs::PointField::FLOAT32) {
+        y = field.offset;
+      } else if (field.name == "z" && field.datatype == sensor_msgs::PointField::FLOAT32) {
+        z = field.offset;
+      } else if (field.name == "intensity") {
+        intensity     = field.offset;
+        intensityType = field.datatype;
+      } else if (field.name == Layout::ringField()) {
+        ring     = field.offset;
+        ringType = field.datatype;
+      } else if (field.name == Layout::timeField()) {
+        time     = field.offset;
+        timeType = field.datatype;
+      }
+    }
+    timeScale    = Layout::timeScale();
+    absoluteTime = Layout::absoluteTime();
+    return x >= 0 && y >= 0 && z >= 0;
+  }
+
+  /** Whether the stream has exactly the offsets and types of the driver layout */
+  template <typename Layout>
+  bool matches() const {
+    return x == 0 && y == 4 && z == 8 &&
+           intensity == Layout::intensity && intensityType == PointFieldType<typename Layout::IntensityType>::value &&
+           ring == Layout::ring && ringType == PointFieldType<typename Layout::RingType>::value &&
+           time == Layout::time && timeType == PointFieldType<typename Layout::TimeType>::value;
+  }
+
+  /** Set the stamp of the message about to be read */
+  void setStamp(double stamp) { timeBase = absoluteTime ? stamp : 0; }
+
+  bool hasRing() const { return ring >= 0; }
+
+  bool hasTime() const { return time >= 0; }
+
+  /** Number of points of a message of this stream */
+  static size_t size(const sensor_msgs::PointCloud2& msg) { return size_t(msg.width) * msg.height; }
+
+  /** Address of the i-th point of a message of this stream */
+  const uint8_t* point(const sensor_msgs::PointCloud2& msg, size_t i) const { return msg.data.data() + i * pointStep; }
+
+  float readX(const uint8_t* point) const { return readUnaligned<float>(point + x); }
+
+  float readY(const uint8_t* point) const { return readUnaligned<float>(point + y); }
+
+  float readZ(const uint8_t* point) const { return readUnaligned<float>(point + z); }
+
+  float readIntensity(const uint8_t* point) const { return intensity >= 0 ? readField(point + intensity, intensityType) : 0; }
+
+  int readRing(const uint8_t* point) const { return ring >= 0 ? readField(point + ring, ringType) : 0; }
+
+  /** Time of the point relative to the message stamp in seconds */
+  double readTime(const uint8_t* point) const { return time >= 0 ? readField(point + time, timeType) * timeScale - timeBase : 0; }
+};
+
+/** Same interface as ``CloudLayout`` for a stream matching the driver layout, with every read inlined */
+template <typename Layout>
+struct FixedCloudLayout {
+  uint32_t pointStep;
+  double timeBase;
+
+  explicit FixedCloudLayout(const CloudLayout& layout) : pointStep(layout.pointStep), timeBase(layout.timeBase) {}
+
+  static size_t size(const sensor_msgs::PointCloud2& msg) { return size_t(msg.width) * msg.height; }
+
+  const uint8_t* point(const sensor_msgs::PointCloud2& msg, size_t i) const { return msg.data.data() + i * pointStep; }
+
+  float readX(const uint8_t* point) const { return readUnaligned<float>(point); }
+
+  float readY(const uint8_t* point) const { return readUnaligned<float>(point + 4); }
+
+  float readZ(const uint8_t* point) const { return readUnaligned<float>(point + 8); }
+
+  float readIntensity(const uint8_t* point) const { return readUnaligned<typename Layout::IntensityType>(point + Layout::intensity); }
+
+  int readRing(const uint8_t* point) const { return readUnaligned<typename Layout::RingType>(point + Layout::ring); }
+
+  double readTime(const uint8_t* point) const { return readUnaligned<typename Layout::TimeType>(point + Layout::time) * Layout::timeScale() - timeBase; }
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <algorithm>
+
+/** Search positions in the IMU and odometry samples, kept per thread as the points of a ring are mostly time-ordered */
+struct DeskewCursor {
+  int imuPointer  = 0;
+  int odomPointer = 0;
+};
+
+/**
+ * First of the IMU samples ``imuTime[0..last)`` after ``pointTime``, or
+ * ``last`` if there is none.
+ *
+ * The search starts from ``start``, the index found for the previous point,
+ * and walks forward or backward from there, so that it takes amortized
+ * constant time for time-ordered points. ``imuTime`` is expected to be sorted;
+ * the index is then the one a linear scan from index 0 finds, for points in
+ * any order.
+ */
+inline int findImuPointer(const double* imuTime, int last, double pointTime, int start) {
+  int front = std::min(std::max(start, 0), last);
+  while (front < last && pointTime >= imuTime[front])
+    ++front;
+  while (front > 0 && pointTime < imuTime[front - 1])
+    --front;
+  return front;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "featureselector.h"
+#include "lio_segmot/cloud_info.h"
+#include "packedcloud.h"
+#include "utility.h"
+
+/**
+ * LOAM edge and surface features of a deskewed cloud, published with its
+ * cloud_info for mapOptimization.
+ *
+ * The clouds come either from the deskew/cloud_info topic (the featureExtraction
+ * node, after ``subscribe()``) or straight from imageProjection in the same
+ * process (``processCloud()``, with fuseFeatureExtraction).
+ */
+class FeatureExtraction : public ParamServer {
+ public:
+  ros::Subscriber subLaserCloudInfo;
+
+  ros::Publisher pubLaserCloudInfo;
+  ros::Publisher pubCornerPoints;
+  ros::Publisher pubSurfacePoints;
+
+  FeatureSelector selector;  // the cloud, its cloud_info and the features extracted from them
+  std_msgs::Header cloudHeader;
+
+  FeatureExtraction() {
+    pubLaserCloudInfo = nh.advertise<lio_segmot::cloud_info>("lio_segmot/feature/cloud_info", 1);
+    pubCornerPoints   = nh.advertise<sensor_msgs::PointCloud2>("lio_segmot/feature/cloud_corner", 1);
+    pubSurfacePoints  = nh.advertise<sensor_msgs::PointCloud2>("lio_segmot/feature/cloud_surface", 1);
+
+    initializationValue();
+  }
+
+  void initializationValue() {
+    selector.N_SCAN               = N_SCAN;
+    selector.Horizon_SCAN         = Horizon_SCAN;
+    selector.edgeThreshold        = edgeThreshold;
+    selector.surfThreshold        = surfThreshold;
+    selector.odometrySurfLeafSize = odometrySurfLeafSize;
+    selector.numberOfCores        = numberOfCores;
+    selector.allocateMemory();
+  }
+
+  void subscribe() {
+    subLaserCloudInfo = nh.subscribe<lio_segmot::cloud_info>("lio_segmot/deskew/cloud_info", 1, &FeatureExtraction::laserCloudInfoHandler, this, ros::TransportHints().tcpNoDelay());
+  }
+
+  void laserCloudInfoHandler(const lio_segmot::cloud_infoConstPtr &msgIn) {
+    lio_segmot::cloud_info &cloudInfo = selector.cloudInfo;
+    cloudInfo                         = *msgIn;         // new cloud info
+    cloudHeader                       = msgIn->header;  // new cloud header
+    if (cloudInfo.version >= packedCloudVersion) {
+      unpackCloud(cloudInfo.cloud_deskewed_packed, selector.extractedCloud.get(), &cloudInfo.pointRange);  // new cloud for extraction
+      cloudInfo.pointColInd.assign(cloudInfo.pointColPacked.begin(), cloudInfo.pointColPacked.end());
+    } else {
+      pcl::fromROSMsg(msgIn->cloud_deskewed, *selector.extractedCloud);
+    }
+
+    selector.calculateSmoothness();
+
+    selector.extractFeatures();
+
+    publishFeatureCloud();
+  }
+
+  /**
+   * Extract and publish the features of a cloud deskewed in the same process: ``info`` has
+   * the unpacked ranges and columns of the points of ``cloud``. Both are handed over for
+   * the call instead of copied; ``info`` comes back with the memory freed before publishing.
+   */
+  void processCloud(lio_segmot::cloud_info *info, pcl::PointCloud<PointType>::Ptr cloud) {
+    std::swap(selector.cloudInfo, *info);
+    selector.extractedCloud.swap(cloud);
+    cloudHeader = selector.cloudInfo.header;
+
+    selector.calculateSmoothness();
+
+    selector.extractFeatures();
+
+    publishFeatureCloud();
+
+    selector.extractedCloud.swap(cloud);
+    std::swap(selector.cloudInfo, *info);
+  }
+
+  void freeCloudInfoMemory() {
+    lio_segmot::cloud_info &cloudInfo = selector.cloudInfo;
+    cloudInfo.startRingIndex.clear();
+    cloudInfo.endRingIndex.clear();
+    cloudInfo.pointColInd.clear();
+    cloudInfo.pointRange.clear();
+    // the packed clouds are kept for mapOptimization, without the ranges
+    cloudInfo.pointColPacked.clear();
+    cloudInfo.cloud_deskewed_packed.range.clear();
+    cloudInfo.cloud_deskewed_packed.overflowRange.clear();
+  }
+
+  void publishFeatureCloud() {
+    // free cloud info memory
+    freeCloudInfoMemory();
+    // save newly extracted features
+    selector.cloudInfo.cloud_corner  = publishCloud(&pubCornerPoints, selector.cornerCloud, cloudHeader.stamp, lidarFrame);
+    selector.cloudInfo.cloud_surface = publishCloud(&pubSurfacePoints, selector.surfaceCloud, cloudHeader.stamp, lidarFrame);
+    // publish to mapOptimization
+    pubLaserCloudInfo.publish(selector.cloudInfo);
+  }
+};
@@ -0,0 +1,287 @@
+#pragma once
+
+#include "lio_segmot/cloud_info.h"
+#include "ringvoxelfilter.h"
+#include "utility.h"
+
+#include <omp.h>
+
+struct smoothness_t {
+  float value;
+  size_t ind;
+};
+
+// ties are ordered by index, as the sub-regions of a ring used to be stably sorted
+struct by_value {
+  bool operator()(smoothness_t const &left, smoothness_t const &right) {
+    return left.value < right.value || (left.value == right.value && left.ind < right.ind);
+  }
+};
+
+// Points per block of calculateSmoothness(), small enough for the ranges of a block to stay in L1
+const int smoothnessBlockSize = 512;
+
+/** Per-point state of feature extraction, one array per field */
+struct FeatureBuffer {
+  std::vector<float> curvature;
+  std::vector<uint8_t> neighborPicked;   // 1 if the point can no longer be picked as a feature
+  std::vector<int8_t> label;             // 1 for edge points
+  std::vector<int8_t> surfacePickState;  // 0: unknown, 1: picked, -1: not picked
+
+  void resize(size_t size) {
+    curvature.resize(size);
+    neighborPicked.resize(size);
+    label.resize(size);
+    surfacePickState.resize(size);
+  }
+};
+
+/** Features of one ring and the buffers to extract them, so that the rings can be processed in parallel */
+struct RingFeatures {
+  std::vector<smoothness_t> edgeCandidates;
+  pcl::PointCloud<PointType>::Ptr cornerCloud;
+  pcl::PointCloud<PointType>::Ptr surfaceCloudScan;
+  pcl::PointCloud<PointType>::Ptr surfaceCloud;  // downsampled surfaceCloudScan
+
+  RingFeatures()
+      : cornerCloud(new pcl::PointCloud<PointType>()),
+        surfaceCloudScan(new pcl::PointCloud<PointType>()),
+        surfaceCloud(new pcl::PointCloud<PointType>()) {}
+};
+
+/**
+ * LOAM edge and surface feature selection of a deskewed cloud, apart from the
+ * ROS node that receives and publishes it: set the parameters, call
+ * ``allocateMemory()``, then for each scan fill ``cloudInfo`` (ranges, columns
+ * and ring indices) and ``extractedCloud`` and call ``calculateSmoothness()``
+ * and ``extractFeatures()``.
+ */
+class FeatureSelector {
+ public:
+  // parameters (ParamServer defaults), set by FeatureExtraction from its ParamServer
+  int N_SCAN                 = 16;
+  int Horizon_SCAN           = 1800;
+  float edgeThreshold        = 0.1;
+  float surfThreshold        = 0.1;
+  float odometrySurfLeafSize = 0.2;
+  int numberOfCores          = 2;
+
+  pcl::PointCloud<PointType>::Ptr extractedCloud;
+  pcl::PointCloud<PointType>::Ptr cornerCloud;
+  pcl::PointCloud<PointType>::Ptr surfaceCloud;
+
+  RingVoxelFilter<PointType> downSizeFilter;
+  std::vector<RingVoxelFilter<PointType>> ringDownSizeFilters;  // one per thread, keeping its buffers between scans
+
+  lio_segmot::cloud_info cloudInfo;
+
+  FeatureBuffer features;
+  std::vector<RingFeatures> ringFeatures;
+
+  void allocateMemory() {
+    features.resize(N_SCAN * Horizon_SCAN);
+    ringFeatures.resize(N_SCAN);
+
+    downSizeFilter.setLeafSize(odometrySurfLeafSize);
+    ringDownSizeFilters.assign(std::max(numberOfCores, 1), downSizeFilter);
+
+    extractedCloud.reset(new pcl::PointCloud<PointType>());
+    cornerCloud.reset(new pcl::PointCloud<PointType>());
+    surfaceCloud.reset(new pcl::PointCloud<PointType>());
+  }
+
+  /**
+   * Curvature of every point, and the occluded and parallel beam points, in a single pass over
+   * the ranges: block by block, the curvature runs as a branch-free (vectorized) loop, then the
+   * occlusion tests of the block while its ranges are still in cache.
+   */
+  void calculateSmoothness() {
+    int cloudSize = extractedCloud->points.size();
+    // a point is cleared before the occlusion test 6 points behind it can mark it
+    std::fill(features.neighborPicked.begin() + std::min(5, cloudSize), features.neighborPicked.begin() + std::min(11, cloudSize), 0);
+
+    for (int begin = 5; begin < cloudSize - 5; begin += smoothnessBlockSize) {
+      int end = std::min(begin + smoothnessBlockSize, cloudSize - 5);
+      curvatureKernel(cloudInfo.pointRange.data(), features.curvature.data(), begin, end);
+      std::fill(features.label.begin() + begin, features.label.begin() + end, 0);
+      std::fill(features.neighborPicked.begin() + begin + 6, features.neighborPicked.begin() + std::min(end + 6, cloudSize), 0);
+      markOccludedPoints(begin, std::min(end, cloudSize - 6));
+    }
+  }
+
+  static void curvatureKernel(const float *range, float *curvature, int begin, int end) {
+    for (int i = begin; i < end; i++) {
+      float diffRange = range[i - 5] + range[i - 4] + range[i - 3] + range[i - 2] + range[i - 1] - range[i] * 10 + range[i + 1] + range[i + 2] + range[i + 3] + range[i + 4] + range[i + 5];
+
+      curvature[i] = diffRange * diffRange;  //diffX * diffX + diffY * diffY + diffZ * diffZ;
+    }
+  }
+
+  void markOccludedPoints(int begin, int end) {
+    const float *range      = cloudInfo.pointRange.data();
+    const int *column       = cloudInfo.pointColInd.data();
+    uint8_t *neighborPicked = features.neighborPicked.data();
+    // mark occluded points and parallel beam points
+    for (int i = begin; i < end; ++i) {
+      // occluded points
+      float depth1   = range[i];
+      float depth2   = range[i + 1];
+      int columnDiff = std::abs(int(column[i + 1] - column[i]));
+
+      if (columnDiff < 10) {
+        // 10 pixel diff in range image
+        if (depth1 - depth2 > 0.3) {
+          std::fill(neighborPicked + i - 5, neighborPicked + i + 1, 1);
+        } else if (depth2 - depth1 > 0.3) {
+          std::fill(neighborPicked + i + 1, neighborPicked + i + 7, 1);
+        }
+      }
+      // parallel beam
+      float diff1 = std::abs(float(range[i - 1] - range[i]));
+      float diff2 = std::abs(float(range[i + 1] - range[i]));
+
+      if (diff1 > 0.02 * range[i] && diff2 > 0.02 * range[i])
+        neighborPicked[i] = 1;
+    }
+  }
+
+  void extractFeatures() {
+    cornerCloud->clear();
+    surfaceCloud->clear();
+
+    // the rings are independent once the occluded points are marked: the neighbours
+    // suppressed around the features of a ring are within the points of that ring
+#pragma omp parallel for num_threads(numberOfCores) schedule(dynamic)
+    for (int i = 0; i < N_SCAN; i++)
+      extractRingFeatures(i, &ringFeatures[i], &ringDownSizeFilters[omp_get_thread_num()]);
+
+    // concatenate in ring order, whatever the thread that processed each ring
+    for (int i = 0; i < N_SCAN; i++) {
+      *cornerCloud  += *ringFeatures[i].cornerCloud;
+      *surfaceCloud += *ringFeatures[i].surfaceCloud;
+    }
+  }
+
+  void extractRingFeatures(int i, RingFeatures *ring, RingVoxelFilter<PointType> *ringDownSizeFilter) {
+    ring->cornerCloud->clear();
+    ring->surfaceCloudScan->clear();
+
+    for (int j = 0; j < 6; j++) {
+      int sp = (cloudInfo.startRingIndex[i] * (6 - j) + cloudInfo.endRingIndex[i] * j) / 6;
+      int ep = (cloudInfo.startRingIndex[i] * (5 - j) + cloudInfo.endRingIndex[i] * (j + 1)) / 6 - 1;
+
+      if (sp >= ep)
+        continue;
+
+      // edges: the unpicked points above edgeThreshold in decreasing curvature, popped from a
+      // heap; the last point of the sub-region is visited first by the edge pass and last by
+      // the surface pass
+      ring->edgeCandidates.clear();
+      for (int k = sp; k < ep; k++) {
+        if (features.curvature[k] > edgeThreshold)
+          ring->edgeCandidates.push_back({features.curvature[k], size_t(k)});
+      }
+      std::make_heap(ring->edgeCandidates.begin(), ring->edgeCandidates.end(), by_value());
+
+      int largestPickedNum = 0;
+      for (int ind = ep; ind >= 0; ind = popEdgeCandidate(&ring->edgeCandidates)) {
+        if (features.neighborPicked[ind] == 0 && features.curvature[ind] > edgeThreshold) {
+          largestPickedNum++;
+          if (largestPickedNum <= 20) {
+            features.label[ind] = 1;
+            ring->cornerCloud->push_back(extractedCloud->points[ind]);
+          } else {
+            break;
+          }
+
+          features.neighborPicked[ind] = 1;
+          markNeighborsPicked(ind);
+        }
+      }
+
+      // surfaces: every point but the edges goes to the surface cloud, so the surface picks
+      // only matter through the neighbours they suppress past the sub-region
+      std::fill(features.surfacePickState.begin() + sp, features.surfacePickState.begin() + ep + 1, 0);
+      for (int k = std::max(sp, ep - 4); k <= ep; k++) {
+        if (surfacePicked(k, sp, ep)) {
+          for (int l = 1; l <= 5; l++) {
+            int columnDiff = std::abs(int(cloudInfo.pointColInd[k + l] - cloudInfo.pointColInd[k + l - 1]));
+            if (columnDiff > 10)
+              break;
+            if (k + l > ep)
+              features.neighborPicked[k + l] = 1;
+          }
+        }
+      }
+
+      for (int k = sp; k <= ep; k++) {
+        if (features.label[k] <= 0) {
+          ring->surfaceCloudScan->push_back(extractedCloud->points[k]);
+        }
+      }
+    }
+
+    ringDownSizeFilter->filter(*ring->surfaceCloudScan, ring->surfaceCloud.get());
+  }
+
+  /** Index of the edge candidate of largest curvature, -1 if there is none left */
+  static int popEdgeCandidate(std::vector<smoothness_t> *edgeCandidates) {
+    if (edgeCandidates->empty())
+      return -1;
+    std::pop_heap(edgeCandidates->begin(), edgeCandidates->end(), by_value());
+    int ind = edgeCandidates->back().ind;
+    edgeCandidates->pop_back();
+    return ind;
+  }
+
+  /** Suppress the (up to 5) neighbours on each side of a picked feature, within 10 columns of each other */
+  void markNeighborsPicked(int ind) {
+    for (int l = 1; l <= 5; l++) {
+      int columnDiff = std::abs(int(cloudInfo.pointColInd[ind + l] - cloudInfo.pointColInd[ind + l - 1]));
+      if (columnDiff > 10)
+        break;
+      features.neighborPicked[ind + l] = 1;
+    }
+    for (int l = -1; l >= -5; l--) {
+      int columnDiff = std::abs(int(cloudInfo.pointColInd[ind + l] - cloudInfo.pointColInd[ind + l + 1]));
+      if (columnDiff > 10)
+        break;
+      features.neighborPicked[ind + l] = 1;
+    }
+  }
+
+  /** Whether the surface pass of sub-region [.., ep] visits point a before point b (ep comes last, it is left out of the sort) */
+  bool surfaceVisitedBefore(int a, int b, int ep) {
+    if (a == ep || b == ep)
+      return b == ep;
+    return features.curvature[a] < features.curvature[b] || (features.curvature[a] == features.curvature[b] && a < b);
+  }
+
+  /**
+   * Whether the surface pass of sub-region [sp, ep] picks point ``ind``. The pass picks the
+   * unpicked points below surfThreshold in increasing curvature and suppresses the neighbours of
+   * each pick, so a point is picked unless a neighbour within reach of lower curvature is.
+   */
+  bool surfacePicked(int ind, int sp, int ep) {
+    int8_t &state = features.surfacePickState[ind];
+    if (state != 0)
+      return state == 1;
+
+    state = features.neighborPicked[ind] == 0 && features.curvature[ind] < surfThreshold ? 1 : -1;
+    for (int l = 1; state == 1 && l <= 5 && ind + l <= ep; l++) {
+      int columnDiff = std::abs(int(cloudInfo.pointColInd[ind + l] - cloudInfo.pointColInd[ind + l - 1]));
+      if (columnDiff > 10)
+        break;
+      if (surfaceVisitedBefore(ind + l, ind, ep) && surfacePicked(ind + l, sp, ep))
+        state = -1;
+    }
+    for (int l = -1; state == 1 && l >= -5 && ind + l >= sp; l--) {
+      int columnDiff = std::abs(int(cloudInfo.pointColInd[ind + l] - cloudInfo.pointColInd[ind + l + 1]));
+      if (columnDiff > 10)
+        break;
+      if (surfaceVisitedBefore(ind + l, ind, ep) && surfacePicked(ind + l, sp, ep))
+        state = -1;
+    }
+    return state == 1;
+  }
+};
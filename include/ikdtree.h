@@ -0,0 +1,385 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <initializer_list>
+#include <memory>
+#include <queue>
+#include <utility>
+#include <vector>
+
+/**
+ * Incremental k-d tree (ikd-tree) for nearest neighbour queries on a map that
+ * changes a little at a time.
+ *
+ * Points are inserted as new leaves and removed lazily (marked as deleted);
+ * each node keeps the size of its subtree, the number of deleted nodes and the
+ * bounding box of its subtree. A subtree is rebuilt from its valid points once
+ * it becomes unbalanced or mostly deleted, so the tree stays shallow without
+ * paying a full rebuild every time the map is touched.
+ *
+ * ``PointT`` is expected to provide ``data[0..2]`` as x/y/z (any PCL point with
+ * ``PCL_ADD_POINT4D``). Queries are const and may run concurrently; updates
+ * must not overlap with queries.
+ */
+template <typename PointT>
+class IncrementalKdTree {
+ public:
+  /**
+   * @param balanceCriterion a subtree is rebuilt once one child holds more than
+   * this fraction of its nodes
+   * @param deleteCriterion a subtree is rebuilt once more than this fraction of
+   * its nodes are deleted
+   * @param minimalRebuildSize subtrees smaller than this are never rebuilt
+   */
+  explicit IncrementalKdTree(float balanceCriterion = 0.7,
+                             float deleteCriterion  = 0.5,
+                             int minimalRebuildSize = 10)
+      : balanceCriterion(balanceCriterion),
+        deleteCriterion(deleteCriterion),
+        minimalRebuildSize(minimalRebuildSize) {}
+
+  /** Replace the content of the tree with the given points */
+  template <typename Container>
+  void build(const Container& points) {
+    std::vector<PointT> buffer(points.begin(), points.end());
+    root = buildSubtree(buffer, 0, buffer.size());
+  }
+
+  /** Remove every point */
+  void clear() { root.reset(); }
+
+  /** Number of valid (not deleted) points */
+  int size() const { return root ? root->size - root->invalidCount : 0; }
+
+  bool empty() const { return size() == 0; }
+
+  /** Insert a single point */
+  void insert(const PointT& point) {
+    std::unique_ptr<Node>* scapegoat = nullptr;
+    insert(root, point, 0, &scapegoat);
+    if (scapegoat != nullptr) rebuild(*scapegoat);
+  }
+
+  /** Insert a batch of points */
+  template <typename Container>
+  void insert(const Container& points) {
+    for (const auto& point : points) insert(point);
+  }
+
+  /**
+   * Remove one point whose coordinates (and intensity) exactly match the given
+   * point. Returns false if no such point is found.
+   */
+  bool remove(const PointT& point) {
+    std::unique_ptr<Node>* scapegoat = nullptr;
+    bool removed                     = remove(root, point, &scapegoat);
+    if (scapegoat != nullptr) rebuild(*scapegoat);
+    return removed;
+  }
+
+  /** Remove a batch of points, returns the number of removed points */
+  template <typename Container>
+  int remove(const Container& points) {
+    int count = 0;
+    for (const auto& point : points) count += remove(point) ? 1 : 0;
+    return count;
+  }
+
+  /**
+   * Remove every point inside the axis-aligned box [boxMin, boxMax], returns
+   * the number of removed points.
+   */
+  int removeBox(const float boxMin[3], const float boxMax[3]) {
+    int count = removeBox(root.get(), boxMin, boxMax);
+    if (root && needsRebuild(root.get())) rebuild(root);
+    return count;
+  }
+
+  /**
+   * Search for the k nearest neighbours of the query point. Neighbours are
+   * returned in ascending order of their squared distances; fewer than k
+   * neighbours are returned if the tree does not hold enough points.
+   */
+  int nearestKSearch(const PointT& query,
+                     int k,
+                     std::vector<PointT>& points,
+                     std::vector<float>& sqDistances) const {
+    points.clear();
+    sqDistances.clear();
+    if (k <= 0) return 0;
+
+    std::priority_queue<std::pair<float, const PointT*>> heap;
+    searchKnn(root.get(), query, k, heap);
+
+    points.resize(heap.size());
+    sqDistances.resize(heap.size());
+    for (int i = heap.size() - 1; i >= 0; --i) {
+      sqDistances[i] = heap.top().first;
+      points[i]      = *heap.top().second;
+      heap.pop();
+    }
+    return points.size();
+  }
+
+  /**
+   * Search for every neighbour within the radius of the query point.
+   * Neighbours are returned in ascending order of their squared distances.
+   */
+  int radiusSearch(const PointT& query,
+                   float radius,
+                   std::vector<PointT>& points,
+                   std::vector<float>& sqDistances) const {
+    std::vector<std::pair<float, const PointT*>> neighbours;
+    searchRadius(root.get(), query, radius * radius, neighbours);
+    std::sort(neighbours.begin(), neighbours.end(),
+              [](const std::pair<float, const PointT*>& n1, const std::pair<float, const PointT*>& n2) { return n1.first < n2.first; });
+
+    points.resize(neighbours.size());
+    sqDistances.resize(neighbours.size());
+    for (size_t i = 0; i < neighbours.size(); ++i) {
+      sqDistances[i] = neighbours[i].first;
+      points[i]      = *neighbours[i].second;
+    }
+    return points.size();
+  }
+
+  /** Append every valid point to the output container */
+  template <typename Container>
+  void flatten(Container& output) const {
+    flatten(root.get(), output);
+  }
+
+ private:
+  struct Node {
+    PointT point;
+    int axis         = 0;
+    int size         = 1;  // number of nodes in the subtree (including deleted ones)
+    int invalidCount = 0;  // number of deleted nodes in the subtree
+    bool deleted     = false;
+    float boxMin[3];
+    float boxMax[3];
+    std::unique_ptr<Node> left;
+    std::unique_ptr<Node> right;
+  };
+
+  std::unique_ptr<Node> root;
+
+  float balanceCriterion;
+  float deleteCriterion;
+  int minimalRebuildSize;
+
+  static float squaredDistance(const PointT& p1, const PointT& p2) {
+    float dx = p1.data[0] - p2.data[0];
+    float dy = p1.data[1] - p2.data[1];
+    float dz = p1.data[2] - p2.data[2];
+    return dx * dx + dy * dy + dz * dz;
+  }
+
+  static float boxSquaredDistance(const Node* node, const PointT& point) {
+    float distance = 0;
+    for (int i = 0; i < 3; ++i) {
+      float d = 0;
+      if (point.data[i] < node->boxMin[i])
+        d = node->boxMin[i] - point.data[i];
+      else if (point.data[i] > node->boxMax[i])
+        d = point.data[i] - node->boxMax[i];
+      distance += d * d;
+    }
+    return distance;
+  }
+
+  static bool isSamePoint(const PointT& p1, const PointT& p2) {
+    return p1.data[0] == p2.data[0] && p1.data[1] == p2.data[1] && p1.data[2] == p2.data[2] &&
+           p1.intensity == p2.intensity;
+  }
+
+  static bool boxContains(const Node* node, const PointT& point) {
+    for (int i = 0; i < 3; ++i)
+      if (point.data[i] < node->boxMin[i] || point.data[i] > node->boxMax[i])
+        return false;
+    return true;
+  }
+
+  static void update(Node* node) {
+    node->size         = 1;
+    node->invalidCount = node->deleted ? 1 : 0;
+    for (int i = 0; i < 3; ++i) {
+      node->boxMin[i] = node->boxMax[i] = node->point.data[i];
+    }
+    for (const Node* child : {node->left.get(), node->right.get()}) {
+      if (child == nullptr) continue;
+      node->size += child->size;
+      node->invalidCount += child->invalidCount;
+      for (int i = 0; i < 3; ++i) {
+        node->boxMin[i] = std::min(node->boxMin[i], child->boxMin[i]);
+        node->boxMax[i] = std::max(node->boxMax[i], child->boxMax[i]);
+      }
+    }
+  }
+
+  bool needsRebuild(const Node* node) const {
+    if (node->size < minimalRebuildSize) return false;
+
+    int leftSize  = node->left ? node->left->size : 0;
+    int rightSize = node->right ? node->right->size : 0;
+    if (std::max(leftSize, rightSize) > balanceCriterion * (node->size - 1)) return true;
+
+    return node->invalidCount > deleteCriterion * node->size;
+  }
+
+  std::unique_ptr<Node> buildSubtree(std::vector<PointT>& points, size_t begin, size_t end) const {
+    if (begin >= end) return nullptr;
+
+    // split along the axis with the largest extent
+    float boxMin[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float boxMax[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (size_t i = begin; i < end; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        boxMin[j] = std::min(boxMin[j], points[i].data[j]);
+        boxMax[j] = std::max(boxMax[j], points[i].data[j]);
+      }
+    }
+    int axis = 0;
+    for (int j = 1; j < 3; ++j)
+      if (boxMax[j] - boxMin[j] > boxMax[axis] - boxMin[axis])
+        axis = j;
+
+    size_t mid = (begin + end) / 2;
+    std::nth_element(points.begin() + begin, points.begin() + mid, points.begin() + end,
+                     [axis](const PointT& p1, const PointT& p2) { return p1.data[axis] < p2.data[axis]; });
+
+    std::unique_ptr<Node> node(new Node());
+    node->point = points[mid];
+    node->axis  = axis;
+    node->left  = buildSubtree(points, begin, mid);
+    node->right = buildSubtree(points, mid + 1, end);
+    update(node.get());
+    return node;
+  }
+
+  void rebuild(std::unique_ptr<Node>& node) {
+    std::vector<PointT> points;
+    points.reserve(node->size - node->invalidCount);
+    flatten(node.get(), points);
+    node = buildSubtree(points, 0, points.size());
+  }
+
+  void insert(std::unique_ptr<Node>& node, const PointT& point, int depth, std::unique_ptr<Node>** scapegoat) {
+    if (!node) {
+      node.reset(new Node());
+      node->point = point;
+      node->axis  = depth % 3;
+      update(node.get());
+      return;
+    }
+
+    if (point.data[node->axis] < node->point.data[node->axis])
+      insert(node->left, point, depth + 1, scapegoat);
+    else
+      insert(node->right, point, depth + 1, scapegoat);
+
+    update(node.get());
+    // the highest unbalanced node on the path is rebuilt after the insertion
+    if (needsRebuild(node.get())) *scapegoat = &node;
+  }
+
+  bool remove(std::unique_ptr<Node>& node, const PointT& point, std::unique_ptr<Node>** scapegoat) {
+    if (!node || node->invalidCount == node->size || !boxContains(node.get(), point)) return false;
+
+    bool removed = false;
+    if (!node->deleted && isSamePoint(node->point, point)) {
+      node->deleted = true;
+      removed       = true;
+    } else {
+      // points equal to the splitting value may sit on either side after a rebuild
+      float diff = point.data[node->axis] - node->point.data[node->axis];
+      if (diff <= 0) removed = remove(node->left, point, scapegoat);
+      if (!removed && diff >= 0) removed = remove(node->right, point, scapegoat);
+    }
+
+    if (removed) {
+      update(node.get());
+      if (needsRebuild(node.get())) *scapegoat = &node;
+    }
+    return removed;
+  }
+
+  int removeBox(Node* node, const float boxMin[3], const float boxMax[3]) {
+    if (node == nullptr || node->invalidCount == node->size) return 0;
+    for (int i = 0; i < 3; ++i)
+      if (node->boxMax[i] < boxMin[i] || node->boxMin[i] > boxMax[i])
+        return 0;
+
+    int count = 0;
+    if (!node->deleted) {
+      bool inside = true;
+      for (int i = 0; i < 3; ++i)
+        inside = inside && node->point.data[i] >= boxMin[i] && node->point.data[i] <= boxMax[i];
+      if (inside) {
+        node->deleted = true;
+        ++count;
+      }
+    }
+    count += removeBox(node->left.get(), boxMin, boxMax);
+    count += removeBox(node->right.get(), boxMin, boxMax);
+
+    if (count > 0) {
+      update(node);
+      if (node->left && needsRebuild(node->left.get())) rebuild(node->left);
+      if (node->right && needsRebuild(node->right.get())) rebuild(node->right);
+      update(node);
+    }
+    return count;
+  }
+
+  void searchKnn(const Node* node,
+                 const PointT& query,
+                 size_t k,
+                 std::priority_queue<std::pair<float, const PointT*>>& heap) const {
+    if (node == nullptr || node->invalidCount == node->size) return;
+    if (heap.size() == k && boxSquaredDistance(node, query) >= heap.top().first) return;
+
+    if (!node->deleted) {
+      float distance = squaredDistance(node->point, query);
+      if (heap.size() < k) {
+        heap.emplace(distance, &node->point);
+      } else if (distance < heap.top().first) {
+        heap.pop();
+        heap.emplace(distance, &node->point);
+      }
+    }
+
+    // visit the side of the query point first to shrink the search radius early
+    if (query.data[node->axis] < node->point.data[node->axis]) {
+      searchKnn(node->left.get(), query, k, heap);
+      searchKnn(node->right.get(), query, k, heap);
+    } else {
+      searchKnn(node->right.get(), query, k, heap);
+      searchKnn(node->left.get(), query, k, heap);
+    }
+  }
+
+  void searchRadius(const Node* node,
+                    const PointT& query,
+                    float sqRadius,
+                    std::vector<std::pair<float, const PointT*>>& neighbours) const {
+    if (node == nullptr || node->invalidCount == node->size) return;
+    if (boxSquaredDistance(node, query) > sqRadius) return;
+
+    if (!node->deleted) {
+      float distance = squaredDistance(node->point, query);
+      if (distance <= sqRadius) neighbours.emplace_back(distance, &node->point);
+    }
+    searchRadius(node->left.get(), query, sqRadius, neighbours);
+    searchRadius(node->right.get(), query, sqRadius, neighbours);
+  }
+
+  template <typename Container>
+  static void flatten(const Node* node, Container& output) {
+    if (node == nullptr || node->invalidCount == node->size) return;
+    flatten(node->left.get(), output);
+    if (!node->deleted) output.push_back(node->point);
+    flatten(node->right.get(), output);
+  }
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+/**
+ * Least-recently-used cache with a memory budget.
+ *
+ * Every entry is stored along with its (estimated) size in bytes; the least
+ * recently used entries are evicted once the total size exceeds the budget.
+ * The most recently inserted entry is never evicted, so a reference returned
+ * by ``get()`` or ``put()`` stays valid until the next insertion.
+ */
+template <typename Key, typename Value>
+class LruCache {
+ public:
+  /**
+   * @param capacity memory budget in bytes
+   */
+  explicit LruCache(size_t capacity = 0) : capacity(capacity) {}
+
+  /** Set the memory budget, evicting entries if needed */
+  void setCapacity(size_t bytes) {
+    capacity = bytes;
+    evict();
+  }
+
+  /** Look up an entry and mark it as recently used, returns nullptr on a miss */
+  const Value* get(const Key& key) {
+    auto it = index.find(key);
+    if (it == index.end()) {
+      ++missCount;
+      return nullptr;
+    }
+    ++hitCount;
+    entries.splice(entries.begin(), entries, it->second);
+    return &it->second->value;
+  }
+
+  /** Insert (or replace) an entry of the given size in bytes */
+  const Value& put(const Key& key, Value value, size_t bytes) {
+    erase(key);
+    entries.push_front(Entry{key, std::move(value), bytes});
+    index[key] = entries.begin();
+    usedBytes += bytes;
+    evict();
+    return entries.front().value;
+  }
+
+  /** Invalidate a single entry, returns false if it is not cached */
+  bool erase(const Key& key) {
+    auto it = index.find(key);
+    if (it == index.end()) return false;
+    usedBytes -= it->second->bytes;
+    entries.erase(it->second);
+    index.erase(it);
+    return true;
+  }
+
+  void clear() {
+    entries.clear();
+    index.clear();
+    usedBytes = 0;
+  }
+
+  /** Number of cached entries */
+  size_t size() const { return entries.size(); }
+
+  /** Total size of the cached entries in bytes */
+  size_t bytes() const { return usedBytes; }
+
+  size_t hits() const { return hitCount; }
+
+  size_t misses() const { return missCount; }
+
+  void resetStatistics() {
+    hitCount  = 0;
+    missCount = 0;
+  }
+
+ private:
+  struct Entry {
+    Key key;
+    Value value;
+    size_t bytes;
+  };
+
+  std::list<Entry> entries;  // most recently used first
+  std::unordered_map<Key, typename std::list<Entry>::iterator> index;
+  size_t capacity;
+  size_t usedBytes = 0;
+  size_t hitCount  = 0;
+  size_t missCount = 0;
+
+  void evict() {
+    while (usedBytes > capacity && entries.size() > 1) {
+      usedBytes -= entries.back().bytes;
+      index.erase(entries.back().key);
+      entries.pop_back();
+    }
+  }
+};
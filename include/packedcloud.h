@@ -0,0 +1,120 @@
+#pragma once
+
+#include "lio_segmot/cloud_info.h"
+#include "lio_segmot/packed_cloud.h"
+#include "utility.h"
+
+/**
+ * Point clouds packed into ``cloud_info`` (message version 2).
+ *
+ * Instead of a PCL cloud of 32 bytes per point, each point of a
+ * ``packed_cloud`` takes 10 bytes: its coordinates as 16-bit integers in
+ * units of ``resolution`` (1 mm) and its intensity. The deskewed cloud also
+ * packs the range of each point (and ``cloud_info`` its range image column),
+ * 14 bytes per point in all. The few points that do not fit in 16 bits at
+ * 1 mm (beyond 32 m, or 65 m for the range) or that are not finite are kept
+ * as float32 in the overflow arrays, so that the resolution is the same for
+ * every scan and every point.
+ */
+const uint8_t packedCloudVersion = 2;
+
+const float packedCloudResolution = 0.001f;
+
+/** Pack ``cloud``, and the range of each of its points unless ``range`` is null */
+inline void packCloud(const pcl::PointCloud<PointType>& cloud, const float* range, lio_segmot::packed_cloud* packed) {
+  const float scale    = 1.0f / packedCloudResolution;
+  const float maxValue = std::numeric_limits<int16_t>::max();
+  const float maxRange = std::numeric_limits<uint16_t>::max();
+
+  size_t size        = cloud.size();
+  packed->resolution = packedCloudResolution;
+  packed->x.resize(size);
+  packed->y.resize(size);
+  packed->z.resize(size);
+  packed->intensity.resize(size);
+  packed->range.resize(range != nullptr ? size : 0);
+  packed->overflowIndex.clear();
+  packed->overflowX.clear();
+  packed->overflowY.clear();
+  packed->overflowZ.clear();
+  packed->overflowRange.clear();
+
+  for (size_t i = 0; i < size; ++i) {
+    const PointType& point = cloud.points[i];
+    float x                = std::round(point.x * scale);
+    float y                = std::round(point.y * scale);
+    float z                = std::round(point.z * scale);
+    float r                = range != nullptr ? std::round(range[i] * scale) : 0;
+    packed->intensity[i]   = point.intensity;
+
+    // written as "not within" so that NaNs overflow
+    if (!(std::abs(x) <= maxValue && std::abs(y) <= maxValue && std::abs(z) <= maxValue && r >= 0 && r <= maxRange)) {
+      packed->x[i] = packed->y[i] = packed->z[i] = 0;
+      packed->overflowIndex.push_back(i);
+      packed->overflowX.push_back(point.x);
+      packed->overflowY.push_back(point.y);
+      packed->overflowZ.push_back(point.z);
+      if (range != nullptr) {
+        packed->range[i] = 0;
+        packed->overflowRange.push_back(range[i]);
+      }
+      continue;
+    }
+
+    packed->x[i] = x;
+    packed->y[i] = y;
+    packed->z[i] = z;
+    if (range != nullptr)
+      packed->range[i] = r;
+  }
+}
+
+/** Unpack the cloud, and the ranges of its points if requested and packed */
+inline void unpackCloud(const lio_segmot::packed_cloud& packed, pcl::PointCloud<PointType>* cloud, std::vector<float>* range = nullptr) {
+  size_t size      = packed.x.size();
+  float resolution = packed.resolution;
+  cloud->resize(size);
+  for (size_t i = 0; i < size; ++i) {
+    PointType& point = cloud->points[i];
+    point.x          = packed.x[i] * resolution;
+    point.y          = packed.y[i] * resolution;
+    point.z          = packed.z[i] * resolution;
+    point.intensity  = packed.intensity[i];
+  }
+  for (size_t k = 0; k < packed.overflowIndex.size(); ++k) {
+    PointType& point = cloud->points[packed.overflowIndex[k]];
+    point.x          = packed.overflowX[k];
+    point.y          = packed.overflowY[k];
+    point.z          = packed.overflowZ[k];
+  }
+
+  if (range != nullptr && !packed.range.empty()) {
+    range->resize(size);
+    for (size_t i = 0; i < size; ++i)
+      (*range)[i] = packed.range[i] * resolution;
+    for (size_t k = 0; k < packed.overflowRange.size(); ++k)
+      (*range)[packed.overflowIndex[k]] = packed.overflowRange[k];
+  }
+}
+
+/** Deskewed cloud of a cloud_info of any version */
+inline void readDeskewedCloud(const lio_segmot::cloud_info& info, pcl::PointCloud<PointType>* cloud) {
+  if (info.version >= packedCloudVersion)
+    unpackCloud(info.cloud_deskewed_packed, cloud);
+  else
+    pcl::fromROSMsg(info.cloud_deskewed, *cloud);
+}
+
+/** Raw cloud message of a cloud_info of any version, in ``frame`` */
+inline sensor_msgs::PointCloud2 readRawCloud(const lio_segmot::cloud_info& info, const std::string& frame) {
+  if (info.version < packedCloudVersion)
+    return info.cloud_raw;
+
+  pcl::PointCloud<PointType> cloud;
+  unpackCloud(info.cloud_raw_packed, &cloud);
+  sensor_msgs::PointCloud2 cloudMsg;
+  pcl::toROSMsg(cloud, cloudMsg);
+  cloudMsg.header.stamp    = info.header.stamp;
+  cloudMsg.header.frame_id = frame;
+  return cloudMsg;
+}
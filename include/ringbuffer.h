@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/**
+ * Fixed-capacity single-producer/single-consumer ring buffer of timestamped
+ * samples.
+ *
+ * One thread may call ``push()`` while another one reads and pops the samples,
+ * without any lock. Every other member is for the consumer only. Samples are
+ * expected to be pushed in increasing order of time, so that ``lowerBound()``
+ * can binary search them.
+ *
+ * ``T`` is expected to be trivially copyable and to provide a ``double time``.
+ */
+template <typename T>
+class RingBuffer {
+ public:
+  /**
+   * @param capacity maximum number of samples, rounded up to a power of two
+   */
+  explicit RingBuffer(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    samples.resize(size);
+    mask = size - 1;
+  }
+
+  /** Append a sample (producer), returns false and drops it if the buffer is full */
+  bool push(const T& sample) {
+    const size_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) > mask) return false;
+    samples[h & mask] = sample;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t capacity() const { return mask + 1; }
+
+  /** Number of samples available to the consumer */
+  size_t size() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed); }
+
+  bool empty() const { return size() == 0; }
+
+  /** The i-th oldest sample, ``i`` must be less than ``size()`` */
+  const T& operator[](size_t i) const { return samples[(tail.load(std::memory_order_relaxed) + i) & mask]; }
+
+  const T& front() const { return (*this)[0]; }
+
+  const T& back() const { return (*this)[size() - 1]; }
+
+  /** Discard the ``n`` oldest samples */
+  void pop(size_t n = 1) { tail.store(tail.load(std::memory_order_relaxed) + n, std::memory_order_release); }
+
+  /** Index of the first sample not older than ``time``, or ``size()`` if there is none */
+  size_t lowerBound(double time) const {
+    size_t first = 0, count = size();
+    while (count > 0) {
+      size_t step = count / 2;
+      if ((*this)[first + step].time < time) {
+        first += step + 1;
+        count -= step + 1;
+      } else {
+        count = step;
+      }
+    }
+    return first;
+  }
+
+ private:
+  std::vector<T> samples;
+  size_t mask;
+
+  // written by the producer and the consumer respectively, kept on separate cache lines
+  std::atomic<size_t> head{0};
+  char padding[64];
+  std::atomic<size_t> tail{0};
+};
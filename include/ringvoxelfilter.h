@@ -0,0 +1,124 @@
+#pragma once
+
+#include <pcl/point_cloud.h>
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Voxel grid downsampling of the points of a lidar ring.
+ *
+ * Replaces the points of each voxel by their centroid, like
+ * ``pcl::VoxelGrid``, without its bounding box pass and index sort. The
+ * points of a ring come in scan order, so consecutive points mostly fall in
+ * the same voxel: such runs are accumulated directly, and the other points
+ * find their voxel in a small open-addressing hash table that is reused from
+ * one call to the next. Voxels are output in the order they are first hit.
+ *
+ * ``PointT`` is expected to provide ``x``, ``y``, ``z`` and ``intensity``.
+ */
+template <typename PointT>
+class RingVoxelFilter {
+ public:
+  void setLeafSize(float leafSize) { inverseLeafSize = 1.0f / leafSize; }
+
+  /** Downsample ``input`` into ``output`` (which must not be ``input``) */
+  void filter(const pcl::PointCloud<PointT>& input, pcl::PointCloud<PointT>* output) {
+    reserve(input.size());
+    voxels.clear();
+    if (++generation == 0) {
+      // the stamps wrapped around, forget every slot
+      for (Slot& slot : slots) slot.generation = 0;
+      generation = 1;
+    }
+
+    int lastVoxel = -1;
+    int lastKey[3] = {0, 0, 0};
+    for (const PointT& point : input.points) {
+      if (!std::isfinite(point.x) || !std::isfinite(point.y) || !std::isfinite(point.z))
+        continue;
+
+      int key[3] = {int(std::floor(point.x * inverseLeafSize)),
+                    int(std::floor(point.y * inverseLeafSize)),
+                    int(std::floor(point.z * inverseLeafSize))};
+      if (lastVoxel < 0 || key[0] != lastKey[0] || key[1] != lastKey[1] || key[2] != lastKey[2]) {
+        lastVoxel  = findVoxel(key);
+        lastKey[0] = key[0];
+        lastKey[1] = key[1];
+        lastKey[2] = key[2];
+      }
+
+      Voxel& voxel = voxels[lastVoxel];
+      voxel.x         += point.x;
+      voxel.y         += point.y;
+      voxel.z         += point.z;
+      voxel.intensity += point.intensity;
+      ++voxel.count;
+    }
+
+    output->resize(voxels.size());
+    for (size_t i = 0; i < voxels.size(); ++i) {
+      const Voxel& voxel = voxels[i];
+      float inverseCount = 1.0f / voxel.count;
+      PointT& centroid   = output->points[i];
+      centroid.x         = voxel.x * inverseCount;
+      centroid.y         = voxel.y * inverseCount;
+      centroid.z         = voxel.z * inverseCount;
+      centroid.intensity = voxel.intensity * inverseCount;
+    }
+  }
+
+ private:
+  struct Voxel {
+    float x;
+    float y;
+    float z;
+    float intensity;
+    int count;
+  };
+
+  struct Slot {
+    int key[3];
+    int voxel;
+    uint32_t generation;  // the slot is empty unless it was filled by the current call
+  };
+
+  /** Make the hash table at most half full for ``size`` points */
+  void reserve(size_t size) {
+    size_t capacity = 16;
+    while (capacity < 2 * size) capacity <<= 1;
+    if (capacity > slots.size()) {
+      slots.assign(capacity, Slot());
+      mask       = capacity - 1;
+      generation = 0;
+    }
+  }
+
+  /** Index of the voxel of ``key``, added if it is not hit yet */
+  int findVoxel(const int* key) {
+    size_t slot = (uint32_t(key[0]) * 73856093u ^ uint32_t(key[1]) * 19349663u ^ uint32_t(key[2]) * 83492791u) & mask;
+    while (slots[slot].generation == generation) {
+      const Slot& candidate = slots[slot];
+      if (candidate.key[0] == key[0] && candidate.key[1] == key[1] && candidate.key[2] == key[2])
+        return candidate.voxel;
+      slot = (slot + 1) & mask;
+    }
+
+    Slot& empty      = slots[slot];
+    empty.key[0]     = key[0];
+    empty.key[1]     = key[1];
+    empty.key[2]     = key[2];
+    empty.voxel      = voxels.size();
+    empty.generation = generation;
+    voxels.push_back(Voxel{0, 0, 0, 0, 0});
+    return empty.voxel;
+  }
+
+  float inverseLeafSize = 1.0f;
+
+  std::vector<Voxel> voxels;
+  std::vector<Slot> slots;
+  size_t mask         = 0;
+  uint32_t generation = 0;
+};
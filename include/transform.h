@@ -0,0 +1,108 @@
+#pragma once
+
+#include <Eigen/Geometry>
+
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LIO_SEGMOT_X86_KERNELS
+#endif
+
+/**
+ * Batched affine transforms of XYZI points.
+ *
+ * ``transformPoints()`` transforms x/y/z of every point and copies the
+ * intensity. The kernel is chosen once at runtime: AVX2 (two points per
+ * instruction) or SSE on x86, a scalar loop elsewhere. Every kernel evaluates
+ * ``r0 * x + r1 * y + r2 * z + t`` in the same order without fused
+ * multiply-adds, so the results are bit-identical whichever kernel runs.
+ *
+ * ``PointT`` is expected to provide ``data[0..3]`` (x/y/z/padding, as with
+ * ``PCL_ADD_POINT4D``) and ``intensity``. ``in`` and ``out`` may alias.
+ */
+namespace transform_kernels {
+
+template <typename PointT>
+using Kernel = void (*)(const PointT*, PointT*, size_t, const Eigen::Affine3f&);
+
+template <typename PointT>
+inline void transformScalar(const PointT* in, PointT* out, size_t size, const Eigen::Affine3f& transform) {
+  for (size_t i = 0; i < size; ++i) {
+    const float x = in[i].data[0], y = in[i].data[1], z = in[i].data[2];
+    out[i].data[0]   = transform(0, 0) * x + transform(0, 1) * y + transform(0, 2) * z + transform(0, 3);
+    out[i].data[1]   = transform(1, 0) * x + transform(1, 1) * y + transform(1, 2) * z + transform(1, 3);
+    out[i].data[2]   = transform(2, 0) * x + transform(2, 1) * y + transform(2, 2) * z + transform(2, 3);
+    out[i].intensity = in[i].intensity;
+  }
+}
+
+#ifdef LIO_SEGMOT_X86_KERNELS
+template <typename PointT>
+inline void transformSSE(const PointT* in, PointT* out, size_t size, const Eigen::Affine3f& transform) {
+  // columns of the 4x4 matrix, so that p' = c0 * x + c1 * y + c2 * z + c3
+  const Eigen::Matrix4f& m = transform.matrix();
+  const __m128 c0          = _mm_loadu_ps(m.col(0).data());
+  const __m128 c1          = _mm_loadu_ps(m.col(1).data());
+  const __m128 c2          = _mm_loadu_ps(m.col(2).data());
+  const __m128 c3          = _mm_loadu_ps(m.col(3).data());
+
+  for (size_t i = 0; i < size; ++i) {
+    const float intensity = in[i].intensity;
+    __m128 p              = _mm_loadu_ps(in[i].data);
+    __m128 r              = _mm_mul_ps(c0, _mm_shuffle_ps(p, p, 0x00));
+    r                     = _mm_add_ps(r, _mm_mul_ps(c1, _mm_shuffle_ps(p, p, 0x55)));
+    r                     = _mm_add_ps(r, _mm_mul_ps(c2, _mm_shuffle_ps(p, p, 0xAA)));
+    r                     = _mm_add_ps(r, c3);
+    _mm_storeu_ps(out[i].data, r);
+    out[i].intensity = intensity;
+  }
+}
+
+template <typename PointT>
+__attribute__((target("avx2"))) inline void transformAVX2(const PointT* in, PointT* out, size_t size, const Eigen::Affine3f& transform) {
+  const Eigen::Matrix4f& m = transform.matrix();
+  const __m256 c0          = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(m.col(0).data()));
+  const __m256 c1          = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(m.col(1).data()));
+  const __m256 c2          = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(m.col(2).data()));
+  const __m256 c3          = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(m.col(3).data()));
+
+  // two points per iteration, one in each 128-bit lane
+  size_t i = 0;
+  for (; i + 1 < size; i += 2) {
+    const float intensity0 = in[i].intensity;
+    const float intensity1 = in[i + 1].intensity;
+    __m256 p               = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(in[i].data)), _mm_loadu_ps(in[i + 1].data), 1);
+    __m256 r               = _mm256_mul_ps(c0, _mm256_permute_ps(p, 0x00));
+    r                      = _mm256_add_ps(r, _mm256_mul_ps(c1, _mm256_permute_ps(p, 0x55)));
+    r                      = _mm256_add_ps(r, _mm256_mul_ps(c2, _mm256_permute_ps(p, 0xAA)));
+    r                      = _mm256_add_ps(r, c3);
+    _mm_storeu_ps(out[i].data, _mm256_castps256_ps128(r));
+    _mm_storeu_ps(out[i + 1].data, _mm256_extractf128_ps(r, 1));
+    out[i].intensity     = intensity0;
+    out[i + 1].intensity = intensity1;
+  }
+  transformSSE(in + i, out + i, size - i, transform);
+}
+#endif
+
+template <typename PointT>
+inline Kernel<PointT> selectKernel() {
+#ifdef LIO_SEGMOT_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return transformAVX2<PointT>;
+  return transformSSE<PointT>;
+#else
+  return transformScalar<PointT>;
+#endif
+}
+
+}  // namespace transform_kernels
+
+/** Transform ``size`` points from ``in`` to ``out`` with the fastest kernel supported by the CPU */
+template <typename PointT>
+inline void transformPoints(const PointT* in, PointT* out, size_t size, const Eigen::Affine3f& transform) {
+  static const transform_kernels::Kernel<PointT> kernel = transform_kernels::selectKernel<PointT>();
+  kernel(in, out, size, transform);
+}
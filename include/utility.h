@@ -39,6 +39,7 @@
 #include <array>
 #include <cfloat>
 #include <cmath>
+#include <condition_variable>
 #include <ctime>
 #include <deque>
 #include <fstream>
@@ -48,6 +49,7 @@
 #include <limits>
 #include <mutex>
 #include <queue>
+#include <set>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -58,7 +60,19 @@ using namespace std;
 typedef pcl::PointXYZI PointType;
 
 enum class SensorType { VELODYNE,
-                        OUSTER };
+                        OUSTER,
+                        HESAI,
+                        LIVOX };
+
+enum class DeskewModeType { ROTATION,
+                            ODOMETRY };
+
+enum class DeskewTimeoutPolicy { DROP,
+                                 DEGRADE };
+
+enum class MapBackendType { KDTREE,
+                            IKDTREE,
+                            VOXEL };
 
 class ParamServer {
  public:
@@ -95,6 +109,10 @@ class ParamServer {
   int downsampleRate;
   float lidarMinRange;
   float lidarMaxRange;
+  int deskewTimeBins;
+  DeskewModeType deskewMode;
+  float deskewWaitTime;
+  DeskewTimeoutPolicy deskewTimeoutPolicy;
 
   // IMU
   float imuAccNoise;
@@ -116,11 +134,18 @@ class ParamServer {
   float surfThreshold;
   int edgeFeatureMinValidNum;
   int surfFeatureMinValidNum;
+  bool fuseFeatureExtraction;
 
   // voxel filter paprams
   float odometrySurfLeafSize;
   float mappingCornerLeafSize;
   float mappingSurfLeafSize;
+  MapBackendType mappingBackend;
+  float mappingVoxelSize;
+  bool mappingFusedNormalEquations;
+  int mappingMaxIterations;
+  float mappingCorrespondenceReuseDistance;
+  float mappingTimeBudget;
 
   float z_tollerance;
   float rotation_tollerance;
@@ -134,6 +159,9 @@ class ParamServer {
   float surroundingkeyframeAddingAngleThreshold;
   float surroundingKeyframeDensity;
   float surroundingKeyframeSearchRadius;
+  float keyFrameCacheSize;
+  float keyFrameTranslationTolerance;
+  float keyFrameRotationTolerance;
 
   // Loop closure
   bool loopClosureEnableFlag;
@@ -218,9 +246,13 @@ class ParamServer {
       sensor = SensorType::VELODYNE;
     } else if (sensorStr == "ouster") {
       sensor = SensorType::OUSTER;
+    } else if (sensorStr == "hesai") {
+      sensor = SensorType::HESAI;
+    } else if (sensorStr == "livox") {
+      sensor = SensorType::LIVOX;
     } else {
       ROS_ERROR_STREAM(
-          "Invalid sensor type (must be either 'velodyne' or 'ouster'): " << sensorStr);
+          "Invalid sensor type (must be 'velodyne', 'ouster', 'hesai' or 'livox'): " << sensorStr);
       ros::shutdown();
     }
 
@@ -229,6 +261,33 @@ class ParamServer {
     nh.param<int>("lio_segmot/downsampleRate", downsampleRate, 1);
     nh.param<float>("lio_segmot/lidarMinRange", lidarMinRange, 1.0);
     nh.param<float>("lio_segmot/lidarMaxRange", lidarMaxRange, 1000.0);
+    nh.param<int>("lio_segmot/deskewTimeBins", deskewTimeBins, 0);
+
+    std::string deskewModeStr;
+    nh.param<std::string>("lio_segmot/deskewMode", deskewModeStr, "rotation");
+    if (deskewModeStr == "rotation") {
+      deskewMode = DeskewModeType::ROTATION;
+    } else if (deskewModeStr == "odometry") {
+      deskewMode = DeskewModeType::ODOMETRY;
+    } else {
+      ROS_ERROR_STREAM(
+          "Invalid deskew mode (must be either 'rotation' or 'odometry'): " << deskewModeStr);
+      ros::shutdown();
+    }
+
+    nh.param<float>("lio_segmot/deskewWaitTime", deskewWaitTime, 0.1);
+
+    std::string deskewTimeoutPolicyStr;
+    nh.param<std::string>("lio_segmot/deskewTimeoutPolicy", deskewTimeoutPolicyStr, "drop");
+    if (deskewTimeoutPolicyStr == "drop") {
+      deskewTimeoutPolicy = DeskewTimeoutPolicy::DROP;
+    } else if (deskewTimeoutPolicyStr == "degrade") {
+      deskewTimeoutPolicy = DeskewTimeoutPolicy::DEGRADE;
+    } else {
+      ROS_ERROR_STREAM(
+          "Invalid deskew timeout policy (must be either 'drop' or 'degrade'): " << deskewTimeoutPolicyStr);
+      ros::shutdown();
+    }
 
     nh.param<float>("lio_segmot/imuAccNoise", imuAccNoise, 0.01);
     nh.param<float>("lio_segmot/imuGyrNoise", imuGyrNoise, 0.001);
@@ -248,11 +307,31 @@ class ParamServer {
     nh.param<float>("lio_segmot/surfThreshold", surfThreshold, 0.1);
     nh.param<int>("lio_segmot/edgeFeatureMinValidNum", edgeFeatureMinValidNum, 10);
     nh.param<int>("lio_segmot/surfFeatureMinValidNum", surfFeatureMinValidNum, 100);
+    nh.param<bool>("lio_segmot/fuseFeatureExtraction", fuseFeatureExtraction, false);
 
     nh.param<float>("lio_segmot/odometrySurfLeafSize", odometrySurfLeafSize, 0.2);
     nh.param<float>("lio_segmot/mappingCornerLeafSize", mappingCornerLeafSize, 0.2);
     nh.param<float>("lio_segmot/mappingSurfLeafSize", mappingSurfLeafSize, 0.2);
 
+    std::string mappingBackendStr;
+    nh.param<std::string>("lio_segmot/mappingBackend", mappingBackendStr, "kdtree");
+    if (mappingBackendStr == "kdtree") {
+      mappingBackend = MapBackendType::KDTREE;
+    } else if (mappingBackendStr == "ikdtree") {
+      mappingBackend = MapBackendType::IKDTREE;
+    } else if (mappingBackendStr == "voxel") {
+      mappingBackend = MapBackendType::VOXEL;
+    } else {
+      ROS_ERROR_STREAM(
+          "Invalid mapping backend (must be 'kdtree', 'ikdtree' or 'voxel'): " << mappingBackendStr);
+      ros::shutdown();
+    }
+    nh.param<float>("lio_segmot/mappingVoxelSize", mappingVoxelSize, 1.0);
+    nh.param<bool>("lio_segmot/mappingFusedNormalEquations", mappingFusedNormalEquations, false);
+    nh.param<int>("lio_segmot/mappingMaxIterations", mappingMaxIterations, 30);
+    nh.param<float>("lio_segmot/mappingCorrespondenceReuseDistance", mappingCorrespondenceReuseDistance, 0.0);
+    nh.param<float>("lio_segmot/mappingTimeBudget", mappingTimeBudget, 0.0);
+
     nh.param<float>("lio_segmot/z_tollerance", z_tollerance, FLT_MAX);
     nh.param<float>("lio_segmot/rotation_tollerance", rotation_tollerance, FLT_MAX);
 
@@ -263,6 +342,9 @@ class ParamServer {
     nh.param<float>("lio_segmot/surroundingkeyframeAddingAngleThreshold", surroundingkeyframeAddingAngleThreshold, 0.2);
     nh.param<float>("lio_segmot/surroundingKeyframeDensity", surroundingKeyframeDensity, 1.0);
     nh.param<float>("lio_segmot/surroundingKeyframeSearchRadius", surroundingKeyframeSearchRadius, 50.0);
+    nh.param<float>("lio_segmot/keyFrameCacheSize", keyFrameCacheSize, 512.0);
+    nh.param<float>("lio_segmot/keyFrameTranslationTolerance", keyFrameTranslationTolerance, 0.001);
+    nh.param<float>("lio_segmot/keyFrameRotationTolerance", keyFrameRotationTolerance, 0.0001);
 
     nh.param<bool>("lio_segmot/loopClosureEnableFlag", loopClosureEnableFlag, false);
     nh.param<float>("lio_segmot/loopClosureFrequency", loopClosureFrequency, 1.0);
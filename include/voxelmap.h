@@ -0,0 +1,287 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <Eigen/Eigenvalues>
+
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+/** Key of the voxel containing the point, same voxel boundaries as pcl::VoxelGrid (21 bits per axis) */
+template <typename PointT>
+inline uint64_t voxelKey(const PointT& point, float inverseLeafSize) {
+  uint64_t key = 0;
+  for (int i = 0; i < 3; ++i) {
+    int64_t index = static_cast<int64_t>(std::floor(point.data[i] * inverseLeafSize));
+    key           = (key << 21) | (static_cast<uint64_t>(index) & 0x1FFFFF);
+  }
+  return key;
+}
+
+/**
+ * Hashed voxel map that keeps one representative point (the centroid,
+ * intensity included) per occupied voxel, like ``pcl::VoxelGrid`` does, but can
+ * be updated by adding and removing points instead of being recomputed from
+ * the whole cloud.
+ *
+ * Every voxel accumulates the sums of its points in double precision, so a
+ * cloud that is removed after being added leaves the other points untouched
+ * (up to rounding). Voxels touched since the last ``commit()`` are tracked so
+ * that a consumer holding the representatives (e.g. a k-d tree) can be patched
+ * with only the representatives that changed.
+ *
+ * ``PointT`` is expected to provide ``data[0..2]`` as x/y/z and ``intensity``.
+ */
+template <typename PointT>
+class VoxelMap {
+ public:
+  explicit VoxelMap(float leafSize = 1.0) { setLeafSize(leafSize); }
+
+  /** Set the voxel size; the map is cleared as the voxels are no longer valid */
+  void setLeafSize(float leafSize) {
+    inverseLeafSize = 1.0 / leafSize;
+    clear();
+  }
+
+  void clear() {
+    voxels.clear();
+    dirtyVoxels.clear();
+  }
+
+  /** Number of occupied voxels */
+  size_t size() const { return voxels.size(); }
+
+  bool empty() const { return voxels.empty(); }
+
+  /** Add a batch of points */
+  template <typename Container>
+  void insert(const Container& points) {
+    for (const auto& point : points) accumulate(point, 1);
+  }
+
+  /** Remove a batch of points previously added with ``insert()`` */
+  template <typename Container>
+  void remove(const Container& points) {
+    for (const auto& point : points) accumulate(point, -1);
+  }
+
+  /**
+   * Refresh the representatives of the voxels touched since the last commit.
+   * The previous representatives of the changed voxels are appended to
+   * ``removed`` and the new ones to ``added``; empty voxels are dropped.
+   */
+  template <typename Container>
+  void commit(Container& removed, Container& added) {
+    for (uint64_t key : dirtyVoxels) {
+      auto it = voxels.find(key);
+      if (it == voxels.end()) continue;
+
+      Voxel& voxel = it->second;
+      voxel.dirty  = false;
+      if (voxel.count > 0) {
+        PointT representative = centroid(voxel);
+        if (voxel.published && isSamePoint(voxel.representative, representative)) continue;
+        if (voxel.published) removed.push_back(voxel.representative);
+        added.push_back(representative);
+        voxel.representative = representative;
+        voxel.published      = true;
+      } else {
+        if (voxel.published) removed.push_back(voxel.representative);
+        voxels.erase(it);
+      }
+    }
+    dirtyVoxels.clear();
+  }
+
+  /** Refresh the representatives without reporting the changes */
+  void commit() {
+    std::vector<PointT> removed, added;
+    commit(removed, added);
+  }
+
+  /** Append the representative of every occupied voxel to the output container */
+  template <typename Container>
+  void flatten(Container& output) const {
+    for (const auto& item : voxels)
+      if (item.second.published) output.push_back(item.second.representative);
+  }
+
+ private:
+  struct Voxel {
+    double sum[4] = {0, 0, 0, 0};  // x, y, z, intensity
+    int count     = 0;
+    bool dirty     = false;
+    bool published = false;
+    PointT representative;
+  };
+
+  std::unordered_map<uint64_t, Voxel> voxels;
+  std::vector<uint64_t> dirtyVoxels;
+  float inverseLeafSize;
+
+  void accumulate(const PointT& point, int sign) {
+    uint64_t key = voxelKey(point, inverseLeafSize);
+    Voxel& voxel = voxels[key];
+    for (int i = 0; i < 3; ++i) voxel.sum[i] += sign * point.data[i];
+    voxel.sum[3] += sign * point.intensity;
+    voxel.count += sign;
+    if (!voxel.dirty) {
+      voxel.dirty = true;
+      dirtyVoxels.push_back(key);
+    }
+  }
+
+  static PointT centroid(const Voxel& voxel) {
+    PointT point;
+    for (int i = 0; i < 3; ++i) point.data[i] = voxel.sum[i] / voxel.count;
+    point.intensity = voxel.sum[3] / voxel.count;
+    return point;
+  }
+
+  static bool isSamePoint(const PointT& p1, const PointT& p2) {
+    return p1.data[0] == p2.data[0] && p1.data[1] == p2.data[1] && p1.data[2] == p2.data[2] &&
+           p1.intensity == p2.intensity;
+  }
+};
+
+/**
+ * Line/plane model of the points inside one voxel of a ``VoxelFeatureMap``
+ */
+struct VoxelFeatureModel {
+  int count       = 0;      // number of points inside the voxel
+  bool lineValid  = false;  // points are spread along one direction
+  bool planeValid = false;  // points lie close to a plane
+  Eigen::Vector3f center;     // mean of the points
+  Eigen::Vector3f direction;  // direction of the principal axis
+  Eigen::Vector3f normal;     // direction of the least principal axis
+};
+
+/**
+ * Hashed sparse voxel map that keeps the running mean and covariance of the
+ * points inside each voxel, together with a cached line/plane model, so that
+ * scan-to-map correspondences are a hash lookup instead of a k-nearest
+ * neighbour search followed by a small eigen decomposition.
+ *
+ * Points are added and removed incrementally; ``update()`` refits the models of
+ * the voxels touched since the last update and must be called before
+ * ``find()``. Lookups are const and may run concurrently.
+ */
+template <typename PointT>
+class VoxelFeatureMap {
+ public:
+  /**
+   * @param leafSize size of the voxels
+   * @param minPointNum voxels with fewer points than this have no valid model
+   * @param lineRatio the points form a line if the largest eigenvalue of the
+   * covariance exceeds this ratio of the second largest one
+   * @param planeThickness the points form a plane if their standard deviation
+   * along the normal is below this value
+   */
+  explicit VoxelFeatureMap(float leafSize       = 1.0,
+                           int minPointNum      = 5,
+                           float lineRatio      = 3.0,
+                           float planeThickness = 0.1)
+      : minPointNum(minPointNum), lineRatio(lineRatio), planeThickness(planeThickness) {
+    setLeafSize(leafSize);
+  }
+
+  /** Set the voxel size; the map is cleared as the voxels are no longer valid */
+  void setLeafSize(float leafSize) {
+    inverseLeafSize = 1.0 / leafSize;
+    clear();
+  }
+
+  void clear() {
+    voxels.clear();
+    dirtyVoxels.clear();
+  }
+
+  /** Number of occupied voxels */
+  size_t size() const { return voxels.size(); }
+
+  bool empty() const { return voxels.empty(); }
+
+  /** Add a batch of points */
+  template <typename Container>
+  void insert(const Container& points) {
+    for (const auto& point : points) accumulate(point, 1);
+  }
+
+  /** Remove a batch of points previously added with ``insert()`` */
+  template <typename Container>
+  void remove(const Container& points) {
+    for (const auto& point : points) accumulate(point, -1);
+  }
+
+  /** Refit the models of the voxels touched since the last update */
+  void update() {
+    for (uint64_t key : dirtyVoxels) {
+      auto it = voxels.find(key);
+      if (it == voxels.end()) continue;
+
+      Voxel& voxel = it->second;
+      voxel.dirty  = false;
+      if (voxel.model.count <= 0) {
+        voxels.erase(it);
+        continue;
+      }
+      fit(voxel);
+    }
+    dirtyVoxels.clear();
+  }
+
+  /** Model of the voxel containing the point, or nullptr if the voxel is empty */
+  const VoxelFeatureModel* find(const PointT& point) const {
+    auto it = voxels.find(voxelKey(point, inverseLeafSize));
+    if (it == voxels.end() || it->second.model.count < minPointNum) return nullptr;
+    return &it->second.model;
+  }
+
+ private:
+  struct Voxel {
+    Eigen::Vector3d sum        = Eigen::Vector3d::Zero();
+    Eigen::Matrix3d sumSquared = Eigen::Matrix3d::Zero();
+    bool dirty                 = false;
+    VoxelFeatureModel model;
+  };
+
+  std::unordered_map<uint64_t, Voxel> voxels;
+  std::vector<uint64_t> dirtyVoxels;
+  float inverseLeafSize;
+  int minPointNum;
+  float lineRatio;
+  float planeThickness;
+
+  void accumulate(const PointT& point, int sign) {
+    uint64_t key = voxelKey(point, inverseLeafSize);
+    Voxel& voxel = voxels[key];
+    Eigen::Vector3d p(point.data[0], point.data[1], point.data[2]);
+    voxel.sum += sign * p;
+    voxel.sumSquared += sign * p * p.transpose();
+    voxel.model.count += sign;
+    if (!voxel.dirty) {
+      voxel.dirty = true;
+      dirtyVoxels.push_back(key);
+    }
+  }
+
+  void fit(Voxel& voxel) const {
+    VoxelFeatureModel& model = voxel.model;
+    model.lineValid          = false;
+    model.planeValid         = false;
+    if (model.count < minPointNum) return;
+
+    Eigen::Vector3d mean       = voxel.sum / model.count;
+    Eigen::Matrix3d covariance = voxel.sumSquared / model.count - mean * mean.transpose();
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(covariance);
+
+    // eigenvalues are sorted in increasing order
+    Eigen::Vector3d eigenvalues = solver.eigenvalues();
+    model.center                = mean.cast<float>();
+    model.direction             = solver.eigenvectors().col(2).cast<float>();
+    model.normal                = solver.eigenvectors().col(0).cast<float>();
+    model.lineValid             = eigenvalues(2) > lineRatio * eigenvalues(1);
+    model.planeValid            = eigenvalues(0) < planeThickness * planeThickness;
+  }
+};
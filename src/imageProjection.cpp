@@ -1,39 +1,99 @@
+#include "cloudlayout.h"
+#include "deskewcursor.h"
+#include "featureextraction.h"
 #include "lio_segmot/cloud_info.h"
+#include "packedcloud.h"
+#include "ringbuffer.h"
+#include "transform.h"
 #include "utility.h"
 
-struct VelodynePointXYZIRT {
-  PCL_ADD_POINT4D
-  PCL_ADD_INTENSITY;
-  uint16_t ring;
-  float time;
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-} EIGEN_ALIGN16;
-POINT_CLOUD_REGISTER_POINT_STRUCT(VelodynePointXYZIRT,
-                                  (float, x, x)(float, y, y)(float, z, z)(float, intensity, intensity)(uint16_t, ring, ring)(float, time, time))
-
-struct OusterPointXYZIRT {
-  PCL_ADD_POINT4D;
-  float intensity;
-  uint32_t t;
-  uint16_t reflectivity;
-  uint8_t ring;
-  uint16_t noise;
-  uint32_t range;
-  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-} EIGEN_ALIGN16;
-POINT_CLOUD_REGISTER_POINT_STRUCT(OusterPointXYZIRT,
-                                  (float, x, x)(float, y, y)(float, z, z)(float, intensity, intensity)(uint32_t, t, t)(uint16_t, reflectivity, reflectivity)(uint8_t, ring, ring)(uint16_t, noise, noise)(uint32_t, range, range))
-
-// Use the Velodyne point format as a common representation
-using PointXYZIRT = VelodynePointXYZIRT;
-
 const int queueLength = 2000;
 
+// Maximum number of scans waiting for the projection thread
+const size_t cloudQueueLength = 5;
+
+// Capacity of the IMU and odometry buffers (several seconds at 1 kHz)
+const int sampleBufferLength = 8192;
+
+/** Compact copy of a (converted) IMU message */
+struct ImuSample {
+  double time;
+  double acc[3];
+  double gyro[3];
+  double orientation[4];  // x, y, z, w
+};
+
+/** Compact copy of an incremental odometry message */
+struct OdomSample {
+  double time;
+  double position[3];
+  double orientation[4];  // x, y, z, w
+  int resetId;            // rounded pose.covariance[0], changes when the IMU preintegration is reset
+};
+
+/** Odometry pose relative to the first one used for the scan (odometry deskew mode) */
+struct OdomPose {
+  double time;
+  Eigen::Quaterniond rotation;
+  Eigen::Vector3d translation;
+};
+
+/**
+ * Per-scan buffers of ImageProjection (range image, ring buckets and IMU
+ * rotation integration), allocated once from the parameters. Resetting only
+ * clears the range image cells written by the last scan.
+ */
+struct ProjectionWorkspace {
+  int rows;
+  int cols;
+
+  std::vector<float> rangeImage;  // rows x cols, row-major, FLT_MAX for empty cells
+  std::vector<int> fullCloudBin;  // deskew time bin of each cell
+
+  // points bucketed by ring, so that each ring of the range image is filled by a single thread
+  std::vector<int> ringPointStart;
+  std::vector<int> ringPoints;
+  std::vector<int> ringFill;        // next free slot of each ring while bucketing
+  std::vector<int> ringCount;   // cells written per ring
+  std::vector<int> ringOffset;  // start of each ring in the extracted cloud
+  std::vector<int> dirtyCells;  // cells written per ring, from ringPointStart[ring] on
+
+  // rotation integrated from the IMU samples of the scan
+  std::vector<double> imuTime;
+  std::vector<double> imuRotX;
+  std::vector<double> imuRotY;
+  std::vector<double> imuRotZ;
+
+  ProjectionWorkspace(int rows, int cols, int imuCapacity)
+      : rows(rows),
+        cols(cols),
+        rangeImage(rows * cols, FLT_MAX),
+        fullCloudBin(rows * cols, 0),
+        ringPointStart(rows + 1, 0),
+        ringFill(rows + 1, 0),
+        ringCount(rows, 0),
+        ringOffset(rows + 1, 0),
+        imuTime(imuCapacity, 0),
+        imuRotX(imuCapacity, 0),
+        imuRotY(imuCapacity, 0),
+        imuRotZ(imuCapacity, 0) {}
+
+  /** Clear the range image cells written by the last scan */
+  void reset() {
+    for (int i = 0; i < rows; ++i)
+      for (int k = ringPointStart[i]; k < ringPointStart[i] + ringCount[i]; ++k)
+        rangeImage[dirtyCells[k]] = FLT_MAX;
+    std::fill(ringCount.begin(), ringCount.end(), 0);
+  }
+};
+
+void quaternionToRPY(const double *orientation, double *roll, double *pitch, double *yaw) {
+  tf::Quaternion quaternion(orientation[0], orientation[1], orientation[2], orientation[3]);
+  tf::Matrix3x3(quaternion).getRPY(*roll, *pitch, *yaw);
+}
+
 class ImageProjection : public ParamServer {
  private:
-  std::mutex imuLock;
-  std::mutex odoLock;
-
   ros::Subscriber subLaserCloud;
   ros::Publisher pubLaserCloud;
 
@@ -42,46 +102,59 @@ class ImageProjection : public ParamServer {
 
   ros::Publisher pubReady;
 
+  // Each handler runs on one spinner thread at a time, so the IMU and odometry
+  // handlers are the single producers and the projection thread the single consumer.
   ros::Subscriber subImu;
-  std::deque<sensor_msgs::Imu> imuQueue;
+  RingBuffer<ImuSample> imuBuffer;
 
   ros::Subscriber subOdom;
-  std::deque<nav_msgs::Odometry> odomQueue;
+  RingBuffer<OdomSample> odomBuffer;
 
-  std::deque<sensor_msgs::PointCloud2> cloudQueue;
-  sensor_msgs::PointCloud2 currentCloudMsg;
+  // scans handed over by cloudHandler() to the projection thread, which wakes
+  // up on a new scan or once the IMU (or odometry) data covers the scan it waits for
+  std::mutex cloudLock;
+  std::condition_variable cloudCondition;
+  std::deque<sensor_msgs::PointCloud2ConstPtr> cloudQueue;
+  std::atomic<double> imuWaitTime;  // end of the scan waiting for IMU and odometry data, DBL_MAX if none
+  bool stopFlag;
 
-  double *imuTime = new double[queueLength];
-  double *imuRotX = new double[queueLength];
-  double *imuRotY = new double[queueLength];
-  double *imuRotZ = new double[queueLength];
+  sensor_msgs::PointCloud2ConstPtr currentCloudMsg;
+  CloudLayout cloudLayout;
+  void (ImageProjection::*projectKernel)();
 
   int imuPointerCur;
-  bool firstPointFlag;
   Eigen::Affine3f transStartInverse;
 
-  pcl::PointCloud<PointXYZIRT>::Ptr laserCloudIn;
-  pcl::PointCloud<PointXYZIRT>::Ptr rawCloudIn;
-  pcl::PointCloud<OusterPointXYZIRT>::Ptr tmpOusterCloudIn;
+  // deskew transforms shared by the points of each time bin (deskewTimeBins > 0)
+  bool binnedDeskewFlag;
+  double deskewTimeStart;
+  double deskewBinWidth;
+  std::vector<Eigen::Affine3f, Eigen::aligned_allocator<Eigen::Affine3f>> deskewTable;
+  std::vector<int> extractedCloudBin;
+
   pcl::PointCloud<PointType>::Ptr rawCloud;
   pcl::PointCloud<PointType>::Ptr fullCloud;
   pcl::PointCloud<PointType>::Ptr extractedCloud;
 
   int deskewFlag;
-  cv::Mat rangeMat;
+  ProjectionWorkspace workspace;
 
   bool odomDeskewFlag;
+  bool odomPoseDeskewFlag;
+  int odomDeskewFallbacks;  // scans deskewed with the rotation only in the odometry deskew mode
+  std::vector<OdomPose, Eigen::aligned_allocator<OdomPose>> odomPoses;
   float odomIncreX;
   float odomIncreY;
   float odomIncreZ;
 
   lio_segmot::cloud_info cloudInfo;
+  std::unique_ptr<FeatureExtraction> featureExtraction;  // features extracted in this process (fuseFeatureExtraction)
   double timeScanCur;
   double timeScanEnd;
   std_msgs::Header cloudHeader;
 
  public:
-  ImageProjection() : deskewFlag(0) {
+  ImageProjection() : imuBuffer(sampleBufferLength), odomBuffer(sampleBufferLength), imuWaitTime(DBL_MAX), stopFlag(false), deskewFlag(0), workspace(N_SCAN, Horizon_SCAN, queueLength), odomDeskewFallbacks(0) {
     subImu        = nh.subscribe<sensor_msgs::Imu>(imuTopic, 2000, &ImageProjection::imuHandler, this, ros::TransportHints().tcpNoDelay());
     subOdom       = nh.subscribe<nav_msgs::Odometry>(odomTopic + "_incremental", 2000, &ImageProjection::odometryHandler, this, ros::TransportHints().tcpNoDelay());
     subLaserCloud = nh.subscribe<sensor_msgs::PointCloud2>(pointCloudTopic, 5, &ImageProjection::cloudHandler, this, ros::TransportHints().tcpNoDelay());
@@ -90,6 +163,9 @@ class ImageProjection : public ParamServer {
     pubLaserCloudInfo = nh.advertise<lio_segmot::cloud_info>("lio_segmot/deskew/cloud_info", 1);
     pubReady          = nh.advertise<std_msgs::Empty>("lio_segmot/ready", 1);
 
+    if (fuseFeatureExtraction)
+      featureExtraction.reset(new FeatureExtraction());
+
     allocateMemory();
     resetParameters();
 
@@ -97,49 +173,68 @@ class ImageProjection : public ParamServer {
   }
 
   void allocateMemory() {
-    laserCloudIn.reset(new pcl::PointCloud<PointXYZIRT>());
-    rawCloudIn.reset(new pcl::PointCloud<PointXYZIRT>());
-    tmpOusterCloudIn.reset(new pcl::PointCloud<OusterPointXYZIRT>());
     rawCloud.reset(new pcl::PointCloud<PointType>());
     fullCloud.reset(new pcl::PointCloud<PointType>());
     extractedCloud.reset(new pcl::PointCloud<PointType>());
 
     fullCloud->points.resize(N_SCAN * Horizon_SCAN);
+    deskewTable.resize(std::max(deskewTimeBins, 0));
 
     cloudInfo.startRingIndex.assign(N_SCAN, 0);
     cloudInfo.endRingIndex.assign(N_SCAN, 0);
 
-    cloudInfo.pointColInd.assign(N_SCAN * Horizon_SCAN, 0);
-    cloudInfo.pointRange.assign(N_SCAN * Horizon_SCAN, 0);
+    // the deskewed cloud is published packed into cloud_info
+    cloudInfo.version = packedCloudVersion;
 
     resetParameters();
   }
 
   void resetParameters() {
-    laserCloudIn->clear();
     extractedCloud->clear();
+    extractedCloudBin.clear();
     // reset range matrix for range image projection
-    rangeMat = cv::Mat(N_SCAN, Horizon_SCAN, CV_32F, cv::Scalar::all(FLT_MAX));
+    workspace.reset();
 
-    imuPointerCur  = 0;
-    firstPointFlag = true;
-    odomDeskewFlag = false;
+    imuPointerCur      = 0;
+    odomDeskewFlag     = false;
+    odomPoseDeskewFlag = false;
+  }
+
+  ~ImageProjection() { stop(); }
 
-    for (int i = 0; i < queueLength; ++i) {
-      imuTime[i] = 0;
-      imuRotX[i] = 0;
-      imuRotY[i] = 0;
-      imuRotZ[i] = 0;
+  /** Wake the projection thread up and let it return */
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(cloudLock);
+      stopFlag = true;
     }
+    cloudCondition.notify_all();
   }
 
-  ~ImageProjection() {}
-
   void imuHandler(const sensor_msgs::Imu::ConstPtr &imuMsg) {
     sensor_msgs::Imu thisImu = imuConverter(*imuMsg);
 
-    std::lock_guard<std::mutex> lock1(imuLock);
-    imuQueue.push_back(thisImu);
+    ImuSample sample;
+    sample.time           = thisImu.header.stamp.toSec();
+    sample.acc[0]         = thisImu.linear_acceleration.x;
+    sample.acc[1]         = thisImu.linear_acceleration.y;
+    sample.acc[2]         = thisImu.linear_acceleration.z;
+    sample.gyro[0]        = thisImu.angular_velocity.x;
+    sample.gyro[1]        = thisImu.angular_velocity.y;
+    sample.gyro[2]        = thisImu.angular_velocity.z;
+    sample.orientation[0] = thisImu.orientation.x;
+    sample.orientation[1] = thisImu.orientation.y;
+    sample.orientation[2] = thisImu.orientation.z;
+    sample.orientation[3] = thisImu.orientation.w;
+    if (!imuBuffer.push(sample))
+      ROS_WARN_THROTTLE(1.0, "IMU buffer is full, dropping IMU data ...");
+
+    // the scan the projection thread waits for is covered now, or the buffer fills up
+    // while no scan comes in and the thread has to trim it
+    if (sample.time >= imuWaitTime.load() || sampleBuffersFilling()) {
+      std::lock_guard<std::mutex> lock(cloudLock);
+      cloudCondition.notify_one();
+    }
 
     // debug IMU data
     // cout << std::setprecision(6);
@@ -160,11 +255,78 @@ class ImageProjection : public ParamServer {
   }
 
   void odometryHandler(const nav_msgs::Odometry::ConstPtr &odometryMsg) {
-    std::lock_guard<std::mutex> lock2(odoLock);
-    odomQueue.push_back(*odometryMsg);
+    OdomSample sample;
+    sample.time           = odometryMsg->header.stamp.toSec();
+    sample.position[0]    = odometryMsg->pose.pose.position.x;
+    sample.position[1]    = odometryMsg->pose.pose.position.y;
+    sample.position[2]    = odometryMsg->pose.pose.position.z;
+    sample.orientation[0] = odometryMsg->pose.pose.orientation.x;
+    sample.orientation[1] = odometryMsg->pose.pose.orientation.y;
+    sample.orientation[2] = odometryMsg->pose.pose.orientation.z;
+    sample.orientation[3] = odometryMsg->pose.pose.orientation.w;
+    sample.resetId        = int(round(odometryMsg->pose.covariance[0]));
+    if (!odomBuffer.push(sample))
+      ROS_WARN_THROTTLE(1.0, "Odometry buffer is full, dropping odometry data ...");
+
+    // the odometry comes from the same IMU data, after it: the scan waits for it as well
+    if (sample.time >= imuWaitTime.load() || sampleBuffersFilling()) {
+      std::lock_guard<std::mutex> lock(cloudLock);
+      cloudCondition.notify_one();
+    }
   }
 
   void cloudHandler(const sensor_msgs::PointCloud2ConstPtr &laserCloudMsg) {
+    bool dropFlag = false;
+    {
+      std::lock_guard<std::mutex> lock(cloudLock);
+      if (cloudQueue.size() >= cloudQueueLength) {
+        cloudQueue.pop_front();
+        dropFlag = true;
+      }
+      cloudQueue.push_back(laserCloudMsg);
+    }
+    cloudCondition.notify_one();
+
+    if (dropFlag) {
+      ROS_WARN_THROTTLE(1.0, "Point cloud queue is full, dropping the oldest scan ...");
+      pubReady.publish(std_msgs::Empty());
+    }
+  }
+
+  /** Process the scans in order as they come in, until stop() is called */
+  void projectionThread() {
+    while (true) {
+      sensor_msgs::PointCloud2ConstPtr laserCloudMsg;
+      {
+        std::unique_lock<std::mutex> lock(cloudLock);
+        cloudCondition.wait(lock, [this] { return stopFlag || !cloudQueue.empty() || sampleBuffersFilling(); });
+        if (stopFlag)
+          return;
+        if (cloudQueue.empty()) {
+          trimSampleBuffers();
+          continue;
+        }
+        laserCloudMsg = cloudQueue.front();
+        cloudQueue.pop_front();
+      }
+      processCloud(laserCloudMsg);
+    }
+  }
+
+  /** Whether the IMU or odometry samples pile up, e.g. while the IMU runs without the lidar */
+  bool sampleBuffersFilling() const {
+    return imuBuffer.size() > imuBuffer.capacity() / 2 || odomBuffer.size() > odomBuffer.capacity() / 2;
+  }
+
+  /** Keep only the newest samples while no scan consumes them, so that the producers never drop fresh data */
+  void trimSampleBuffers() {
+    if (imuBuffer.size() > imuBuffer.capacity() / 4)
+      imuBuffer.pop(imuBuffer.size() - imuBuffer.capacity() / 4);
+    if (odomBuffer.size() > odomBuffer.capacity() / 4)
+      odomBuffer.pop(odomBuffer.size() - odomBuffer.capacity() / 4);
+  }
+
+  void processCloud(const sensor_msgs::PointCloud2ConstPtr &laserCloudMsg) {
     if (!cachePointCloud(laserCloudMsg) || !deskewInfo()) {
       pubReady.publish(std_msgs::Empty());
       return;
@@ -180,55 +342,33 @@ class ImageProjection : public ParamServer {
   }
 
   bool cachePointCloud(const sensor_msgs::PointCloud2ConstPtr &laserCloudMsg) {
-    // cache point cloud
-    cloudQueue.push_back(*laserCloudMsg);
-    if (cloudQueue.size() <= 2)
-      return false;
-
-    // convert cloud
-    currentCloudMsg = std::move(cloudQueue.front());
-    cloudQueue.pop_front();
-    if (sensor == SensorType::VELODYNE) {
-      pcl::moveFromROSMsg(currentCloudMsg, *rawCloudIn);
-      *laserCloudIn += *rawCloudIn;
-
-      rawCloud->clear();
-      for (const auto &p : *rawCloudIn) {
-        PointType xyzi;
-        xyzi.x         = p.x;
-        xyzi.y         = p.y;
-        xyzi.z         = p.z;
-        xyzi.intensity = p.intensity;
-
-        rawCloud->push_back(xyzi);
-      }
-    } else if (sensor == SensorType::OUSTER) {
-      // Convert to Velodyne format
-      pcl::moveFromROSMsg(currentCloudMsg, *tmpOusterCloudIn);
-      laserCloudIn->points.resize(tmpOusterCloudIn->size());
-      laserCloudIn->is_dense = tmpOusterCloudIn->is_dense;
-      for (size_t i = 0; i < tmpOusterCloudIn->size(); i++) {
-        auto &src     = tmpOusterCloudIn->points[i];
-        auto &dst     = laserCloudIn->points[i];
-        dst.x         = src.x;
-        dst.y         = src.y;
-        dst.z         = src.z;
-        dst.intensity = src.intensity;
-        dst.ring      = src.ring;
-        dst.time      = src.t * 1e-9f;
+    // points are read in place from the message, without converting it
+    currentCloudMsg = laserCloudMsg;
+
+    // resolve the field offsets of the stream
+    static int layoutFlag = 0;
+    if (layoutFlag == 0) {
+      layoutFlag = resolveCloudLayout(*currentCloudMsg) ? 1 : -1;
+      if (layoutFlag == -1) {
+        ROS_ERROR("Point cloud x/y/z channels not available, please configure your point cloud data!");
+        ros::shutdown();
       }
-    } else {
-      ROS_ERROR_STREAM("Unknown sensor type: " << int(sensor));
-      ros::shutdown();
     }
+    if (layoutFlag == -1)
+      return false;
+
+    size_t cloudSize = cloudLayout.size(*currentCloudMsg);
+    if (cloudSize == 0)
+      return false;
 
     // get timestamp
-    cloudHeader = currentCloudMsg.header;
+    cloudHeader = currentCloudMsg->header;
     timeScanCur = cloudHeader.stamp.toSec();
-    timeScanEnd = timeScanCur + laserCloudIn->points.back().time;
+    cloudLayout.setStamp(timeScanCur);
+    timeScanEnd = timeScanCur + cloudLayout.readTime(cloudLayout.point(*currentCloudMsg, cloudSize - 1));
 
     // check dense flag
-    if (laserCloudIn->is_dense == false) {
+    if (currentCloudMsg->is_dense == false) {
       ROS_ERROR("Point cloud is not in dense format, please remove NaN points first!");
       ros::shutdown();
     }
@@ -236,13 +376,7 @@ class ImageProjection : public ParamServer {
     // check ring channel
     static int ringFlag = 0;
     if (ringFlag == 0) {
-      ringFlag = -1;
-      for (int i = 0; i < (int)currentCloudMsg.fields.size(); ++i) {
-        if (currentCloudMsg.fields[i].name == "ring") {
-          ringFlag = 1;
-          break;
-        }
-      }
+      ringFlag = cloudLayout.hasRing() ? 1 : -1;
       if (ringFlag == -1) {
         ROS_ERROR("Point cloud ring channel not available, please configure your point cloud data!");
         ros::shutdown();
@@ -251,13 +385,7 @@ class ImageProjection : public ParamServer {
 
     // check point time
     if (deskewFlag == 0) {
-      deskewFlag = -1;
-      for (auto &field : currentCloudMsg.fields) {
-        if (field.name == "time" || field.name == "t") {
-          deskewFlag = 1;
-          break;
-        }
-      }
+      deskewFlag = cloudLayout.hasTime() ? 1 : -1;
       if (deskewFlag == -1)
         ROS_WARN("Point cloud timestamp not available, deskew function disabled, system will drift significantly!");
     }
@@ -265,19 +393,87 @@ class ImageProjection : public ParamServer {
     return true;
   }
 
+  /** Resolve the point layout of the stream and pick the projection kernel for it */
+  bool resolveCloudLayout(const sensor_msgs::PointCloud2 &msg) {
+    switch (sensor) {
+      case SensorType::VELODYNE:
+        return resolveCloudLayout<VelodyneLayout>(msg);
+      case SensorType::OUSTER:
+        return resolveCloudLayout<OusterLayout>(msg);
+      case SensorType::HESAI:
+        return resolveCloudLayout<HesaiLayout>(msg);
+      case SensorType::LIVOX:
+        return resolveCloudLayout<LivoxLayout>(msg);
+    }
+    ROS_ERROR_STREAM("Unknown sensor type: " << int(sensor));
+    return false;
+  }
+
+  template <typename Layout>
+  bool resolveCloudLayout(const sensor_msgs::PointCloud2 &msg) {
+    if (!cloudLayout.resolve<Layout>(msg))
+      return false;
+
+    // inline every field read when the stream has exactly the driver layout
+    if (cloudLayout.matches<Layout>()) {
+      projectKernel = &ImageProjection::projectPoints<FixedCloudLayout<Layout>>;
+    } else {
+      ROS_INFO("Point cloud layout differs from the default driver layout, using the generic point reader.");
+      projectKernel = &ImageProjection::projectPoints<CloudLayout>;
+    }
+    return true;
+  }
+
+  /**
+   * Wait until the IMU data covers the scan, and the odometry too if it is received (the IMU
+   * preintegration publishes it after the IMU data it integrates), for at most deskewWaitTime
+   */
+  void waitForImu() {
+    imuWaitTime = timeScanEnd;
+    {
+      std::unique_lock<std::mutex> lock(cloudLock);
+      cloudCondition.wait_for(lock, std::chrono::duration<double>(deskewWaitTime), [this] {
+        return stopFlag || (!imuBuffer.empty() && imuBuffer.back().time >= timeScanEnd &&
+                            (odomBuffer.empty() || odomBuffer.back().time >= timeScanEnd));
+      });
+    }
+    imuWaitTime = DBL_MAX;
+  }
+
   bool deskewInfo() {
-    std::lock_guard<std::mutex> lock1(imuLock);
-    std::lock_guard<std::mutex> lock2(odoLock);
+    // drop the samples that are too old for this scan (and thus for any later one),
+    // making room for the samples it waits for
+    imuBuffer.pop(imuBuffer.lowerBound(timeScanCur - 0.01));
+    odomBuffer.pop(odomBuffer.lowerBound(timeScanCur - 0.01));
+
+    waitForImu();
 
     // make sure IMU data available for the scan
-    if (imuQueue.empty() || imuQueue.front().header.stamp.toSec() > timeScanCur || imuQueue.back().header.stamp.toSec() < timeScanEnd) {
-      ROS_DEBUG("Waiting for IMU data ...");
-      return false;
+    bool imuStartFlag = !imuBuffer.empty() && imuBuffer.front().time <= timeScanCur;
+    bool imuEndFlag   = !imuBuffer.empty() && imuBuffer.back().time >= timeScanEnd;
+    if (!imuStartFlag || !imuEndFlag) {
+      if (deskewTimeoutPolicy == DeskewTimeoutPolicy::DROP) {
+        ROS_DEBUG("IMU data not available for the scan, dropping it ...");
+        return false;
+      }
+      ROS_WARN_THROTTLE(1.0, "IMU data does not cover the scan, deskewing it with the IMU data available ...");
     }
 
-    imuDeskewInfo();
+    // without an IMU sample before the scan there is no initial orientation for it
+    if (imuStartFlag)
+      imuDeskewInfo();
+    else
+      cloudInfo.imuAvailable = false;
 
     odomDeskewInfo();
+    if (deskewMode == DeskewModeType::ODOMETRY && !odomPoseDeskewFlag)
+      ROS_WARN_THROTTLE(1.0, "Odometry does not cover the scan, deskewing it with the IMU rotation only (%d scans so far) ...", ++odomDeskewFallbacks);
+
+    binnedDeskewFlag = deskewTimeBins > 0 && deskewFlag == 1 && cloudInfo.imuAvailable;
+    if (binnedDeskewFlag) {
+      deskewTimeStart = cloudLayout.readTime(cloudLayout.point(*currentCloudMsg, 0));
+      deskewBinWidth  = (timeScanEnd - timeScanCur - deskewTimeStart) / deskewTimeBins;
+    }
 
     return true;
   }
@@ -285,48 +481,47 @@ class ImageProjection : public ParamServer {
   void imuDeskewInfo() {
     cloudInfo.imuAvailable = false;
 
-    while (!imuQueue.empty()) {
-      if (imuQueue.front().header.stamp.toSec() < timeScanCur - 0.01)
-        imuQueue.pop_front();
-      else
-        break;
-    }
-
-    if (imuQueue.empty())
+    if (imuBuffer.empty())
       return;
 
     imuPointerCur = 0;
 
-    for (int i = 0; i < (int)imuQueue.size(); ++i) {
-      sensor_msgs::Imu thisImuMsg = imuQueue[i];
-      double currentImuTime       = thisImuMsg.header.stamp.toSec();
+    for (size_t i = 0, imuSize = imuBuffer.size(); i < imuSize; ++i) {
+      const ImuSample &thisImu = imuBuffer[i];
+      double currentImuTime    = thisImu.time;
 
       // get roll, pitch, and yaw estimation for this scan
-      if (currentImuTime <= timeScanCur)
-        imuRPY2rosRPY(&thisImuMsg, &cloudInfo.imuRollInit, &cloudInfo.imuPitchInit, &cloudInfo.imuYawInit);
+      if (currentImuTime <= timeScanCur) {
+        double imuRoll, imuPitch, imuYaw;
+        quaternionToRPY(thisImu.orientation, &imuRoll, &imuPitch, &imuYaw);
+        cloudInfo.imuRollInit  = imuRoll;
+        cloudInfo.imuPitchInit = imuPitch;
+        cloudInfo.imuYawInit   = imuYaw;
+      }
 
-      if (currentImuTime > timeScanEnd + 0.01)
+      if (currentImuTime > timeScanEnd + 0.01 || imuPointerCur == queueLength)
         break;
 
       if (imuPointerCur == 0) {
-        imuRotX[0] = 0;
-        imuRotY[0] = 0;
-        imuRotZ[0] = 0;
-        imuTime[0] = currentImuTime;
+        workspace.imuRotX[0] = 0;
+        workspace.imuRotY[0] = 0;
+        workspace.imuRotZ[0] = 0;
+        workspace.imuTime[0] = currentImuTime;
         ++imuPointerCur;
         continue;
       }
 
       // get angular velocity
-      double angular_x, angular_y, angular_z;
-      imuAngular2rosAngular(&thisImuMsg, &angular_x, &angular_y, &angular_z);
+      double angular_x = thisImu.gyro[0];
+      double angular_y = thisImu.gyro[1];
+      double angular_z = thisImu.gyro[2];
 
       // integrate rotation
-      double timeDiff        = currentImuTime - imuTime[imuPointerCur - 1];
-      imuRotX[imuPointerCur] = imuRotX[imuPointerCur - 1] + angular_x * timeDiff;
-      imuRotY[imuPointerCur] = imuRotY[imuPointerCur - 1] + angular_y * timeDiff;
-      imuRotZ[imuPointerCur] = imuRotZ[imuPointerCur - 1] + angular_z * timeDiff;
-      imuTime[imuPointerCur] = currentImuTime;
+      double timeDiff                  = currentImuTime - workspace.imuTime[imuPointerCur - 1];
+      workspace.imuRotX[imuPointerCur] = workspace.imuRotX[imuPointerCur - 1] + angular_x * timeDiff;
+      workspace.imuRotY[imuPointerCur] = workspace.imuRotY[imuPointerCur - 1] + angular_y * timeDiff;
+      workspace.imuRotZ[imuPointerCur] = workspace.imuRotZ[imuPointerCur - 1] + angular_z * timeDiff;
+      workspace.imuTime[imuPointerCur] = currentImuTime;
       ++imuPointerCur;
     }
 
@@ -340,42 +535,25 @@ class ImageProjection : public ParamServer {
 
   void odomDeskewInfo() {
     cloudInfo.odomAvailable = false;
+    odomPoseDeskewFlag      = false;
 
-    while (!odomQueue.empty()) {
-      if (odomQueue.front().header.stamp.toSec() < timeScanCur - 0.01)
-        odomQueue.pop_front();
-      else
-        break;
-    }
-
-    if (odomQueue.empty())
+    if (odomBuffer.empty())
       return;
 
-    if (odomQueue.front().header.stamp.toSec() > timeScanCur)
+    if (odomBuffer.front().time > timeScanCur)
       return;
 
     // get start odometry at the beinning of the scan
-    nav_msgs::Odometry startOdomMsg;
-
-    for (int i = 0; i < (int)odomQueue.size(); ++i) {
-      startOdomMsg = odomQueue[i];
-
-      if (ROS_TIME(&startOdomMsg) < timeScanCur)
-        continue;
-      else
-        break;
-    }
-
-    tf::Quaternion orientation;
-    tf::quaternionMsgToTF(startOdomMsg.pose.pose.orientation, orientation);
+    size_t startIndex           = std::min(odomBuffer.lowerBound(timeScanCur), odomBuffer.size() - 1);
+    const OdomSample &startOdom = odomBuffer[startIndex];
 
     double roll, pitch, yaw;
-    tf::Matrix3x3(orientation).getRPY(roll, pitch, yaw);
+    quaternionToRPY(startOdom.orientation, &roll, &pitch, &yaw);
 
     // Initial guess used in mapOptimization
-    cloudInfo.initialGuessX     = startOdomMsg.pose.pose.position.x;
-    cloudInfo.initialGuessY     = startOdomMsg.pose.pose.position.y;
-    cloudInfo.initialGuessZ     = startOdomMsg.pose.pose.position.z;
+    cloudInfo.initialGuessX     = startOdom.position[0];
+    cloudInfo.initialGuessY     = startOdom.position[1];
+    cloudInfo.initialGuessZ     = startOdom.position[2];
     cloudInfo.initialGuessRoll  = roll;
     cloudInfo.initialGuessPitch = pitch;
     cloudInfo.initialGuessYaw   = yaw;
@@ -385,28 +563,19 @@ class ImageProjection : public ParamServer {
     // get end odometry at the end of the scan
     odomDeskewFlag = false;
 
-    if (odomQueue.back().header.stamp.toSec() < timeScanEnd)
+    if (odomBuffer.back().time < timeScanEnd)
       return;
 
-    nav_msgs::Odometry endOdomMsg;
-
-    for (int i = 0; i < (int)odomQueue.size(); ++i) {
-      endOdomMsg = odomQueue[i];
-
-      if (ROS_TIME(&endOdomMsg) < timeScanEnd)
-        continue;
-      else
-        break;
-    }
+    size_t endIndex           = std::min(odomBuffer.lowerBound(timeScanEnd), odomBuffer.size() - 1);
+    const OdomSample &endOdom = odomBuffer[endIndex];
 
-    if (int(round(startOdomMsg.pose.covariance[0])) != int(round(endOdomMsg.pose.covariance[0])))
+    if (startOdom.resetId != endOdom.resetId)
       return;
 
-    Eigen::Affine3f transBegin = pcl::getTransformation(startOdomMsg.pose.pose.position.x, startOdomMsg.pose.pose.position.y, startOdomMsg.pose.pose.position.z, roll, pitch, yaw);
+    Eigen::Affine3f transBegin = pcl::getTransformation(startOdom.position[0], startOdom.position[1], startOdom.position[2], roll, pitch, yaw);
 
-    tf::quaternionMsgToTF(endOdomMsg.pose.pose.orientation, orientation);
-    tf::Matrix3x3(orientation).getRPY(roll, pitch, yaw);
-    Eigen::Affine3f transEnd = pcl::getTransformation(endOdomMsg.pose.pose.position.x, endOdomMsg.pose.pose.position.y, endOdomMsg.pose.pose.position.z, roll, pitch, yaw);
+    quaternionToRPY(endOdom.orientation, &roll, &pitch, &yaw);
+    Eigen::Affine3f transEnd = pcl::getTransformation(endOdom.position[0], endOdom.position[1], endOdom.position[2], roll, pitch, yaw);
 
     Eigen::Affine3f transBt = transBegin.inverse() * transEnd;
 
@@ -414,31 +583,61 @@ class ImageProjection : public ParamServer {
     pcl::getTranslationAndEulerAngles(transBt, odomIncreX, odomIncreY, odomIncreZ, rollIncre, pitchIncre, yawIncre);
 
     odomDeskewFlag = true;
+
+    if (deskewMode == DeskewModeType::ODOMETRY)
+      cacheOdomPoses(startIndex, endIndex);
+  }
+
+  /** Keep the odometry poses covering the scan, relative to the first one, for the odometry deskew mode */
+  void cacheOdomPoses(size_t startIndex, size_t endIndex) {
+    // start from the last pose before the scan if it belongs to the same trajectory
+    if (startIndex > 0 && odomBuffer[startIndex - 1].resetId == odomBuffer[startIndex].resetId)
+      --startIndex;
+
+    odomPoses.clear();
+
+    Eigen::Affine3d baseInverse;
+    for (size_t i = startIndex; i <= endIndex; ++i) {
+      const OdomSample &sample = odomBuffer[i];
+      if (sample.resetId != odomBuffer[endIndex].resetId)
+        return;
+
+      Eigen::Quaterniond rotation(sample.orientation[3], sample.orientation[0], sample.orientation[1], sample.orientation[2]);
+      Eigen::Affine3d pose = Eigen::Translation3d(sample.position[0], sample.position[1], sample.position[2]) * rotation.normalized();
+      if (i == startIndex)
+        baseInverse = pose.inverse();
+      pose = baseInverse * pose;
+
+      OdomPose odomPose;
+      odomPose.time        = sample.time;
+      odomPose.rotation    = Eigen::Quaterniond(pose.rotation());
+      odomPose.translation = pose.translation();
+      odomPoses.push_back(odomPose);
+    }
+
+    odomPoseDeskewFlag = true;
   }
 
-  void findRotation(double pointTime, float *rotXCur, float *rotYCur, float *rotZCur) {
+  void findRotation(double pointTime, DeskewCursor *cursor, float *rotXCur, float *rotYCur, float *rotZCur) {
     *rotXCur = 0;
     *rotYCur = 0;
     *rotZCur = 0;
 
-    int imuPointerFront = 0;
-    while (imuPointerFront < imuPointerCur) {
-      if (pointTime < imuTime[imuPointerFront])
-        break;
-      ++imuPointerFront;
-    }
+    // first IMU sample after the point, starting from the one of the previous point
+    int imuPointerFront = findImuPointer(workspace.imuTime.data(), imuPointerCur, pointTime, cursor->imuPointer);
+    cursor->imuPointer  = imuPointerFront;
 
-    if (pointTime > imuTime[imuPointerFront] || imuPointerFront == 0) {
-      *rotXCur = imuRotX[imuPointerFront];
-      *rotYCur = imuRotY[imuPointerFront];
-      *rotZCur = imuRotZ[imuPointerFront];
+    if (pointTime > workspace.imuTime[imuPointerFront] || imuPointerFront == 0) {
+      *rotXCur = workspace.imuRotX[imuPointerFront];
+      *rotYCur = workspace.imuRotY[imuPointerFront];
+      *rotZCur = workspace.imuRotZ[imuPointerFront];
     } else {
       int imuPointerBack = imuPointerFront - 1;
-      double ratioFront  = (pointTime - imuTime[imuPointerBack]) / (imuTime[imuPointerFront] - imuTime[imuPointerBack]);
-      double ratioBack   = (imuTime[imuPointerFront] - pointTime) / (imuTime[imuPointerFront] - imuTime[imuPointerBack]);
-      *rotXCur           = imuRotX[imuPointerFront] * ratioFront + imuRotX[imuPointerBack] * ratioBack;
-      *rotYCur           = imuRotY[imuPointerFront] * ratioFront + imuRotY[imuPointerBack] * ratioBack;
-      *rotZCur           = imuRotZ[imuPointerFront] * ratioFront + imuRotZ[imuPointerBack] * ratioBack;
+      double ratioFront  = (pointTime - workspace.imuTime[imuPointerBack]) / (workspace.imuTime[imuPointerFront] - workspace.imuTime[imuPointerBack]);
+      double ratioBack   = (workspace.imuTime[imuPointerFront] - pointTime) / (workspace.imuTime[imuPointerFront] - workspace.imuTime[imuPointerBack]);
+      *rotXCur           = workspace.imuRotX[imuPointerFront] * ratioFront + workspace.imuRotX[imuPointerBack] * ratioBack;
+      *rotYCur           = workspace.imuRotY[imuPointerFront] * ratioFront + workspace.imuRotY[imuPointerBack] * ratioBack;
+      *rotZCur           = workspace.imuRotZ[imuPointerFront] * ratioFront + workspace.imuRotZ[imuPointerBack] * ratioBack;
     }
   }
 
@@ -459,26 +658,64 @@ class ImageProjection : public ParamServer {
     // *posZCur = ratio * odomIncreZ;
   }
 
-  PointType deskewPoint(PointType *point, double relTime) {
-    if (deskewFlag == -1 || cloudInfo.imuAvailable == false)
-      return *point;
+  /** Pose at pointTime, interpolated linearly on SE(3) between the odometry poses around it */
+  Eigen::Affine3f findPose(double pointTime, DeskewCursor *cursor) {
+    // last pose before the point, starting from the one of the previous point
+    int last = odomPoses.size() - 1;
+    int back = std::min(cursor->odomPointer, std::max(last - 1, 0));
+    while (back + 1 < last && pointTime >= odomPoses[back + 1].time)
+      ++back;
+    while (back > 0 && pointTime < odomPoses[back].time)
+      --back;
+    cursor->odomPointer = back;
+
+    const OdomPose &poseBack  = odomPoses[back];
+    const OdomPose &poseFront = odomPoses[std::min(back + 1, last)];
+    double ratio              = 0;
+    if (poseFront.time > poseBack.time)
+      ratio = std::min(std::max((pointTime - poseBack.time) / (poseFront.time - poseBack.time), 0.0), 1.0);
+
+    Eigen::Vector3d translation = poseBack.translation + ratio * (poseFront.translation - poseBack.translation);
+    Eigen::Affine3d pose        = Eigen::Translation3d(translation) * poseBack.rotation.slerp(ratio, poseFront.rotation);
+    return pose.cast<float>();
+  }
 
+  /** Sensor pose at relTime, from the odometry or the integrated IMU rotation */
+  Eigen::Affine3f findTransform(double relTime, DeskewCursor *cursor) {
     double pointTime = timeScanCur + relTime;
 
+    if (odomPoseDeskewFlag)
+      return findPose(pointTime, cursor);
+
     float rotXCur, rotYCur, rotZCur;
-    findRotation(pointTime, &rotXCur, &rotYCur, &rotZCur);
+    findRotation(pointTime, cursor, &rotXCur, &rotYCur, &rotZCur);
 
     float posXCur, posYCur, posZCur;
     findPosition(relTime, &posXCur, &posYCur, &posZCur);
 
-    if (firstPointFlag == true) {
-      transStartInverse = (pcl::getTransformation(posXCur, posYCur, posZCur, rotXCur, rotYCur, rotZCur)).inverse();
-      firstPointFlag    = false;
-    }
+    return pcl::getTransformation(posXCur, posYCur, posZCur, rotXCur, rotYCur, rotZCur);
+  }
+
+  /** Deskew the scan to the sensor pose at relTime (the first projected point) and build the bin table */
+  void setDeskewReference(double relTime) {
+    DeskewCursor cursor;
+    transStartInverse = findTransform(relTime, &cursor).inverse();
+
+    if (binnedDeskewFlag)
+      for (int i = 0; i < deskewTimeBins; ++i)
+        deskewTable[i] = transStartInverse * findTransform(deskewTimeStart + (i + 0.5) * deskewBinWidth, &cursor);
+  }
+
+  bool deskewAvailable() const {
+    return deskewFlag == 1 && cloudInfo.imuAvailable;
+  }
+
+  PointType deskewPoint(PointType *point, double relTime, DeskewCursor *cursor) {
+    if (!deskewAvailable())
+      return *point;
 
     // transform points to start
-    Eigen::Affine3f transFinal = pcl::getTransformation(posXCur, posYCur, posZCur, rotXCur, rotYCur, rotZCur);
-    Eigen::Affine3f transBt    = transStartInverse * transFinal;
+    Eigen::Affine3f transBt = transStartInverse * findTransform(relTime, cursor);
 
     PointType newPoint;
     newPoint.x         = transBt(0, 0) * point->x + transBt(0, 1) * point->y + transBt(0, 2) * point->z + transBt(0, 3);
@@ -489,76 +726,200 @@ class ImageProjection : public ParamServer {
     return newPoint;
   }
 
+  /** Time bin of a point in the deskew table */
+  int deskewBin(double relTime) const {
+    if (deskewBinWidth <= 0)
+      return 0;
+    int bin = int((relTime - deskewTimeStart) / deskewBinWidth);
+    return std::min(std::max(bin, 0), deskewTimeBins - 1);
+  }
+
+  /** Deskew a range of the extracted cloud with the transform of each time bin, one run of consecutive points at a time */
+  void applyDeskewTable(size_t begin, size_t end) {
+    PointType *points = extractedCloud->points.data();
+    for (size_t runBegin = begin, runEnd; runBegin < end; runBegin = runEnd) {
+      runEnd = runBegin + 1;
+      while (runEnd < end && extractedCloudBin[runEnd] == extractedCloudBin[runBegin])
+        ++runEnd;
+      transformPoints(points + runBegin, points + runBegin, runEnd - runBegin, deskewTable[extractedCloudBin[runBegin]]);
+    }
+  }
+
+  /** Range image cell of a point of the given ring, or -1 if the point is filtered out */
+  int cellIndex(const PointType &point, int rowIdn, float *range) const {
+    *range = pointDistance(point);
+    if (*range < lidarMinRange || *range > lidarMaxRange)
+      return -1;
+
+    float horizonAngle = atan2(point.x, point.y) * 180 / M_PI;
+
+    float ang_res_x = 360.0 / float(Horizon_SCAN);
+    int columnIdn   = -round((horizonAngle - 90.0) / ang_res_x) + Horizon_SCAN / 2;
+    if (columnIdn >= Horizon_SCAN)
+      columnIdn -= Horizon_SCAN;
+
+    if (columnIdn < 0 || columnIdn >= Horizon_SCAN)
+      return -1;
+
+    return columnIdn + rowIdn * Horizon_SCAN;
+  }
+
   void projectPointCloud() {
-    int cloudSize = laserCloudIn->points.size();
-    // range image projection
+    (this->*projectKernel)();
+  }
+
+  /** Range image projection, specialized for the point layout of the stream */
+  template <typename Reader>
+  void projectPoints() {
+    const Reader reader(cloudLayout);
+    const sensor_msgs::PointCloud2 &cloudMsg = *currentCloudMsg;
+    int cloudSize                            = reader.size(cloudMsg);
+    rawCloud->resize(cloudSize);
+
+    // read the points and count them per ring; the first point to be projected is the deskew reference
+    std::fill(workspace.ringPointStart.begin(), workspace.ringPointStart.end(), 0);
+    workspace.ringPoints.resize(cloudSize);
+    workspace.dirtyCells.resize(cloudSize);
+    int referencePoint = -1;
     for (int i = 0; i < cloudSize; ++i) {
-      PointType thisPoint;
-      thisPoint.x         = laserCloudIn->points[i].x;
-      thisPoint.y         = laserCloudIn->points[i].y;
-      thisPoint.z         = laserCloudIn->points[i].z;
-      thisPoint.intensity = laserCloudIn->points[i].intensity;
-
-      float range = pointDistance(thisPoint);
-      if (range < lidarMinRange || range > lidarMaxRange)
-        continue;
+      const uint8_t *rawPoint = reader.point(cloudMsg, i);
 
-      int rowIdn = laserCloudIn->points[i].ring;
+      PointType &thisPoint = rawCloud->points[i];
+      thisPoint.x          = reader.readX(rawPoint);
+      thisPoint.y          = reader.readY(rawPoint);
+      thisPoint.z          = reader.readZ(rawPoint);
+      thisPoint.intensity  = reader.readIntensity(rawPoint);
+
+      int rowIdn = reader.readRing(rawPoint);
       if (rowIdn < 0 || rowIdn >= N_SCAN)
         continue;
 
       if (rowIdn % downsampleRate != 0)
         continue;
 
-      float horizonAngle = atan2(thisPoint.x, thisPoint.y) * 180 / M_PI;
-
-      static float ang_res_x = 360.0 / float(Horizon_SCAN);
-      int columnIdn          = -round((horizonAngle - 90.0) / ang_res_x) + Horizon_SCAN / 2;
-      if (columnIdn >= Horizon_SCAN)
-        columnIdn -= Horizon_SCAN;
+      ++workspace.ringPointStart[rowIdn + 1];
 
-      if (columnIdn < 0 || columnIdn >= Horizon_SCAN)
-        continue;
-
-      if (rangeMat.at<float>(rowIdn, columnIdn) != FLT_MAX)
-        continue;
-
-      thisPoint = deskewPoint(&thisPoint, laserCloudIn->points[i].time);
+      float range;
+      if (referencePoint < 0 && cellIndex(thisPoint, rowIdn, &range) >= 0)
+        referencePoint = i;
+    }
 
-      rangeMat.at<float>(rowIdn, columnIdn) = range;
+    // bucket the points by ring, in their original order
+    for (int i = 0; i < N_SCAN; ++i)
+      workspace.ringPointStart[i + 1] += workspace.ringPointStart[i];
+    std::copy(workspace.ringPointStart.begin(), workspace.ringPointStart.end(), workspace.ringFill.begin());
+    for (int i = 0; i < cloudSize; ++i) {
+      int rowIdn = reader.readRing(reader.point(cloudMsg, i));
+      if (rowIdn >= 0 && rowIdn < N_SCAN && rowIdn % downsampleRate == 0)
+        workspace.ringPoints[workspace.ringFill[rowIdn]++] = i;
+    }
 
-      int index                = columnIdn + rowIdn * Horizon_SCAN;
-      fullCloud->points[index] = thisPoint;
+    if (deskewAvailable() && referencePoint >= 0)
+      setDeskewReference(reader.readTime(reader.point(cloudMsg, referencePoint)));
+
+    // range image projection, one ring per thread
+#pragma omp parallel for num_threads(numberOfCores) schedule(dynamic)
+    for (int rowIdn = 0; rowIdn < N_SCAN; ++rowIdn) {
+      DeskewCursor cursor;
+      int count = 0;
+      for (int k = workspace.ringPointStart[rowIdn]; k < workspace.ringPointStart[rowIdn + 1]; ++k) {
+        PointType thisPoint = rawCloud->points[workspace.ringPoints[k]];
+
+        float range;
+        int index = cellIndex(thisPoint, rowIdn, &range);
+        if (index < 0 || workspace.rangeImage[index] != FLT_MAX)
+          continue;
+
+        // binned deskew is applied to the extracted cloud
+        double relTime = reader.readTime(reader.point(cloudMsg, workspace.ringPoints[k]));
+        if (binnedDeskewFlag)
+          workspace.fullCloudBin[index] = deskewBin(relTime);
+        else
+          thisPoint = deskewPoint(&thisPoint, relTime, &cursor);
+
+        workspace.rangeImage[index]                                    = range;
+        workspace.dirtyCells[workspace.ringPointStart[rowIdn] + count] = index;
+        fullCloud->points[index]                                       = thisPoint;
+        ++count;
+      }
+      workspace.ringCount[rowIdn] = count;
     }
   }
 
   void cloudExtraction() {
-    int count = 0;
+    // start of each ring in the extracted cloud
+    workspace.ringOffset[0] = 0;
+    for (int i = 0; i < N_SCAN; ++i)
+      workspace.ringOffset[i + 1] = workspace.ringOffset[i] + workspace.ringCount[i];
+    extractedCloud->resize(workspace.ringOffset[N_SCAN]);
+    if (binnedDeskewFlag)
+      extractedCloudBin.resize(workspace.ringOffset[N_SCAN]);
+
+    // per-point arrays: the ranges and columns are kept unpacked when the features are extracted
+    // in this process, otherwise they are packed with the deskewed cloud. processCloud() swaps
+    // cloudInfo back with its ring indices, ranges and columns cleared, so they are all resized
+    // every scan; the packed x/y/z/intensity arrays are sized by packCloud()
+    cloudInfo.pointRange.resize(workspace.ringOffset[N_SCAN]);
+    if (featureExtraction)
+      cloudInfo.pointColInd.resize(workspace.ringOffset[N_SCAN]);
+    else
+      cloudInfo.pointColPacked.resize(workspace.ringOffset[N_SCAN]);
+    cloudInfo.startRingIndex.resize(N_SCAN);
+    cloudInfo.endRingIndex.resize(N_SCAN);
+
     // extract segmented cloud for lidar odometry
+#pragma omp parallel for num_threads(numberOfCores)
     for (int i = 0; i < N_SCAN; ++i) {
+      int count                   = workspace.ringOffset[i];
       cloudInfo.startRingIndex[i] = count - 1 + 5;
 
       for (int j = 0; j < Horizon_SCAN; ++j) {
-        if (rangeMat.at<float>(i, j) != FLT_MAX) {
+        if (workspace.rangeImage[j + i * Horizon_SCAN] != FLT_MAX) {
           // mark the points' column index for marking occlusion later
-          cloudInfo.pointColInd[count] = j;
+          if (featureExtraction)
+            cloudInfo.pointColInd[count] = j;
+          else
+            cloudInfo.pointColPacked[count] = j;
           // save range info
-          cloudInfo.pointRange[count] = rangeMat.at<float>(i, j);
+          cloudInfo.pointRange[count] = workspace.rangeImage[j + i * Horizon_SCAN];
           // save extracted cloud
-          extractedCloud->push_back(fullCloud->points[j + i * Horizon_SCAN]);
+          extractedCloud->points[count] = fullCloud->points[j + i * Horizon_SCAN];
+          if (binnedDeskewFlag)
+            extractedCloudBin[count] = workspace.fullCloudBin[j + i * Horizon_SCAN];
           // size of extracted cloud
           ++count;
         }
       }
       cloudInfo.endRingIndex[i] = count - 1 - 5;
+
+      if (binnedDeskewFlag)
+        applyDeskewTable(workspace.ringOffset[i], count);
+    }
+
+    // pack the deskewed cloud, with the ranges unless they stay unpacked for the features
+    // extracted in this process
+    if (featureExtraction) {
+      packCloud(*extractedCloud, nullptr, &cloudInfo.cloud_deskewed_packed);
+    } else {
+      packCloud(*extractedCloud, cloudInfo.pointRange.data(), &cloudInfo.cloud_deskewed_packed);
+      cloudInfo.pointRange.clear();
     }
   }
 
   void publishClouds() {
-    cloudInfo.header         = cloudHeader;
-    cloudInfo.cloud_raw      = publishCloud(&pubExtractedCloud, rawCloud, cloudHeader.stamp, lidarFrame);
-    cloudInfo.cloud_deskewed = publishCloud(&pubExtractedCloud, extractedCloud, cloudHeader.stamp, lidarFrame);
-    pubLaserCloudInfo.publish(cloudInfo);
+    cloudInfo.header = cloudHeader;
+    // the raw and deskewed clouds are packed into cloud_info, they are only converted for the deskew topic
+    packCloud(*rawCloud, nullptr, &cloudInfo.cloud_raw_packed);
+    if (pubExtractedCloud.getNumSubscribers() != 0) {
+      publishCloud(&pubExtractedCloud, rawCloud, cloudHeader.stamp, lidarFrame);
+      publishCloud(&pubExtractedCloud, extractedCloud, cloudHeader.stamp, lidarFrame);
+    }
+
+    // with the features extracted in this process, cloud_info goes straight to mapOptimization
+    if (featureExtraction)
+      featureExtraction->processCloud(&cloudInfo, extractedCloud);
+    else
+      pubLaserCloudInfo.publish(cloudInfo);
   }
 };
 
@@ -569,8 +930,13 @@ int main(int argc, char **argv) {
 
   ROS_INFO("\033[1;32m----> Image Projection Started.\033[0m");
 
+  std::thread projectionThread(&ImageProjection::projectionThread, &IP);
+
   ros::MultiThreadedSpinner spinner(3);
   spinner.spin();
 
+  IP.stop();
+  projectionThread.join();
+
   return 0;
 }
@@ -1,5 +1,7 @@
 #include <jsk_topic_tools/color_utils.h>
 #include "factor.h"
+#include "ikdtree.h"
+#include "lrucache.h"
 #include "lio_segmot/Diagnosis.h"
 #include "lio_segmot/ObjectStateArray.h"
 #include "lio_segmot/cloud_info.h"
@@ -7,9 +9,13 @@
 #include "lio_segmot/flags.h"
 #include "lio_segmot/save_estimation_result.h"
 #include "lio_segmot/save_map.h"
+#include "packedcloud.h"
 #include "solver.h"
+#include "transform.h"
 #include "utility.h"
+#include "voxelmap.h"
 
+#include <omp.h>
 #include <visualization_msgs/MarkerArray.h>
 
 #include <gtsam/geometry/Pose3.h>
@@ -230,6 +236,106 @@ class Timer {
   }
 };
 
+/*
+ * Structure-of-arrays buffer of the scan-to-map residuals. Every feature point
+ * owns one slot (corner points first, then surf points) that is filled in
+ * parallel and flagged in the byte mask; compact() then packs the valid slots
+ * to the front in their original order.
+ */
+class ResidualBuffer {
+ public:
+  std::vector<float> x, y, z;                           // feature point in the lidar frame
+  std::vector<float> coeffX, coeffY, coeffZ, residual;  // weighted direction and distance
+  std::vector<uint8_t> mask;                            // 1 if the slot holds a valid residual
+  int size = 0;
+
+  void resize(int capacity) {
+    for (auto* v : {&x, &y, &z, &coeffX, &coeffY, &coeffZ, &residual})
+      v->resize(capacity);
+    mask.resize(capacity);
+  }
+
+  void reset(int slots) {
+    size = slots;
+    std::fill(mask.begin(), mask.begin() + slots, 0);
+  }
+
+  void set(int i, const PointType& point, const PointType& coeff) {
+    x[i]        = point.x;
+    y[i]        = point.y;
+    z[i]        = point.z;
+    coeffX[i]   = coeff.x;
+    coeffY[i]   = coeff.y;
+    coeffZ[i]   = coeff.z;
+    residual[i] = coeff.intensity;
+    mask[i]     = 1;
+  }
+
+  void compact() {
+    int count = 0;
+    for (int i = 0; i < size; ++i) {
+      if (!mask[i])
+        continue;
+      x[count]        = x[i];
+      y[count]        = y[i];
+      z[count]        = z[i];
+      coeffX[count]   = coeffX[i];
+      coeffY[count]   = coeffY[i];
+      coeffZ[count]   = coeffZ[i];
+      residual[count] = residual[i];
+      ++count;
+    }
+    size = count;
+  }
+};
+
+/*
+ * Line/plane model found for one feature point, kept across the LM iterations
+ * of a scan and reused as long as the point stays close to where it was
+ * searched
+ */
+struct FeatureCorrespondence {
+  bool searched = false;
+  bool valid    = false;
+  float searchedAt[3];        // feature point in the map frame when the model was searched
+  Eigen::Vector3f center;     // line center (corner)
+  Eigen::Vector3f direction;  // line direction (corner)
+  Eigen::Vector4f plane;      // plane coefficients (surf)
+
+  bool reusableAt(const PointType& point, float distance) const {
+    if (!searched)
+      return false;
+    float dx = point.x - searchedAt[0];
+    float dy = point.y - searchedAt[1];
+    float dz = point.z - searchedAt[2];
+    return dx * dx + dy * dy + dz * dz < distance * distance;
+  }
+
+  void setSearchedAt(const PointType& point) {
+    searched      = true;
+    searchedAt[0] = point.x;
+    searchedAt[1] = point.y;
+    searchedAt[2] = point.z;
+  }
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/** Partial sums of the scan-to-map normal equations (upper triangle of AtA) */
+struct NormalEquations {
+  Eigen::Matrix<double, 6, 6> AtA;
+  Eigen::Matrix<double, 6, 1> AtB;
+  int selNum;
+
+  void setZero() {
+    AtA.setZero();
+    AtB.setZero();
+    selNum = 0;
+  }
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
 class mapOptimization : public ParamServer {
  public:
   // gtsam
@@ -303,27 +409,33 @@ class mapOptimization : public ParamServer {
   pcl::PointCloud<PointType>::Ptr laserCloudCornerLastDS;  // downsampled corner featuer set from odoOptimization
   pcl::PointCloud<PointType>::Ptr laserCloudSurfLastDS;    // downsampled surf featuer set from odoOptimization
 
-  pcl::PointCloud<PointType>::Ptr laserCloudOri;
-  pcl::PointCloud<PointType>::Ptr coeffSel;
+  std::vector<PointType> laserCloudSelCornerVec;  // corner points transformed to the map frame
+  std::vector<PointType> laserCloudSelSurfVec;    // surf points transformed to the map frame
+  ResidualBuffer residuals;                       // residual holder for parallel computation
+  std::vector<NormalEquations, Eigen::aligned_allocator<NormalEquations>> threadNormalEquations;  // per-thread partial sums
 
-  std::vector<PointType> laserCloudOriCornerVec;  // corner point holder for parallel computation
-  std::vector<PointType> coeffSelCornerVec;
-  std::vector<bool> laserCloudOriCornerFlag;
-  std::vector<PointType> laserCloudOriSurfVec;  // surf point holder for parallel computation
-  std::vector<PointType> coeffSelSurfVec;
-  std::vector<bool> laserCloudOriSurfFlag;
+  std::vector<FeatureCorrespondence, Eigen::aligned_allocator<FeatureCorrespondence>> cornerCorrespondences;
+  std::vector<FeatureCorrespondence, Eigen::aligned_allocator<FeatureCorrespondence>> surfCorrespondences;
+  int numberOfIterations             = 0;  // statistics of the last scan-to-map optimization
+  int numberOfCorrespondenceSearches = 0;
+  double scanToMapTime               = 0;
 
-  map<int, pair<pcl::PointCloud<PointType>, pcl::PointCloud<PointType>>> laserCloudMapContainer;
-  pcl::PointCloud<PointType>::Ptr laserCloudCornerFromMap;
-  pcl::PointCloud<PointType>::Ptr laserCloudSurfFromMap;
+  LruCache<int, pair<pcl::PointCloud<PointType>, pcl::PointCloud<PointType>>> laserCloudMapContainer;  // transformed key frames
   pcl::PointCloud<PointType>::Ptr laserCloudCornerFromMapDS;
   pcl::PointCloud<PointType>::Ptr laserCloudSurfFromMapDS;
 
   pcl::KdTreeFLANN<PointType>::Ptr kdtreeCornerFromMap;
   pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurfFromMap;
 
-  pcl::KdTreeFLANN<PointType>::Ptr kdtreeSurroundingKeyPoses;
-  pcl::KdTreeFLANN<PointType>::Ptr kdtreeHistoryKeyPoses;
+  VoxelMap<PointType> voxelMapCornerFromMap;  // downsampled local map, updated with the key frames entering/leaving it
+  VoxelMap<PointType> voxelMapSurfFromMap;
+  IncrementalKdTree<PointType> ikdtreeCornerFromMap;  // incrementally updated local map (mappingBackend: ikdtree)
+  IncrementalKdTree<PointType> ikdtreeSurfFromMap;
+  VoxelFeatureMap<PointType> voxelFeatureMapCorner;  // per-voxel line/plane models of the local map (mappingBackend: voxel)
+  VoxelFeatureMap<PointType> voxelFeatureMapSurf;
+  std::set<int> keyFramesInMap;  // key frames currently inserted into the local map
+
+  IncrementalKdTree<PointType> keyPoseIndex;  // positions of the key poses, updated with cloudKeyPoses3D (guarded by mtx)
 
   pcl::VoxelGrid<PointType> downSizeFilterCorner;
   pcl::VoxelGrid<PointType> downSizeFilterSurf;
@@ -440,6 +552,11 @@ class mapOptimization : public ParamServer {
     downSizeFilterSurf.setLeafSize(mappingSurfLeafSize, mappingSurfLeafSize, mappingSurfLeafSize);
     downSizeFilterICP.setLeafSize(mappingSurfLeafSize, mappingSurfLeafSize, mappingSurfLeafSize);
     downSizeFilterSurroundingKeyPoses.setLeafSize(surroundingKeyframeDensity, surroundingKeyframeDensity, surroundingKeyframeDensity);  // for surrounding key poses of scan-to-map optimization
+    voxelMapCornerFromMap.setLeafSize(mappingCornerLeafSize);
+    voxelMapSurfFromMap.setLeafSize(mappingSurfLeafSize);
+    laserCloudMapContainer.setCapacity(keyFrameCacheSize * 1024 * 1024);
+    voxelFeatureMapCorner.setLeafSize(mappingVoxelSize);
+    voxelFeatureMapSurf.setLeafSize(mappingVoxelSize);
 
     allocateMemory();
   }
@@ -450,29 +567,18 @@ class mapOptimization : public ParamServer {
     copy_cloudKeyPoses3D.reset(new pcl::PointCloud<PointType>());
     copy_cloudKeyPoses6D.reset(new pcl::PointCloud<PointTypePose>());
 
-    kdtreeSurroundingKeyPoses.reset(new pcl::KdTreeFLANN<PointType>());
-    kdtreeHistoryKeyPoses.reset(new pcl::KdTreeFLANN<PointType>());
 
     laserCloudCornerLast.reset(new pcl::PointCloud<PointType>());    // corner feature set from odoOptimization
     laserCloudSurfLast.reset(new pcl::PointCloud<PointType>());      // surf feature set from odoOptimization
     laserCloudCornerLastDS.reset(new pcl::PointCloud<PointType>());  // downsampled corner featuer set from odoOptimization
     laserCloudSurfLastDS.reset(new pcl::PointCloud<PointType>());    // downsampled surf featuer set from odoOptimization
 
-    laserCloudOri.reset(new pcl::PointCloud<PointType>());
-    coeffSel.reset(new pcl::PointCloud<PointType>());
-
-    laserCloudOriCornerVec.resize(N_SCAN * Horizon_SCAN);
-    coeffSelCornerVec.resize(N_SCAN * Horizon_SCAN);
-    laserCloudOriCornerFlag.resize(N_SCAN * Horizon_SCAN);
-    laserCloudOriSurfVec.resize(N_SCAN * Horizon_SCAN);
-    coeffSelSurfVec.resize(N_SCAN * Horizon_SCAN);
-    laserCloudOriSurfFlag.resize(N_SCAN * Horizon_SCAN);
+    laserCloudSelCornerVec.resize(N_SCAN * Horizon_SCAN);
+    laserCloudSelSurfVec.resize(N_SCAN * Horizon_SCAN);
+    residuals.resize(2 * N_SCAN * Horizon_SCAN);
+    cornerCorrespondences.resize(N_SCAN * Horizon_SCAN);
+    surfCorrespondences.resize(N_SCAN * Horizon_SCAN);
 
-    std::fill(laserCloudOriCornerFlag.begin(), laserCloudOriCornerFlag.end(), false);
-    std::fill(laserCloudOriSurfFlag.begin(), laserCloudOriSurfFlag.end(), false);
-
-    laserCloudCornerFromMap.reset(new pcl::PointCloud<PointType>());
-    laserCloudSurfFromMap.reset(new pcl::PointCloud<PointType>());
     laserCloudCornerFromMapDS.reset(new pcl::PointCloud<PointType>());
     laserCloudSurfFromMapDS.reset(new pcl::PointCloud<PointType>());
 
@@ -551,7 +657,7 @@ class mapOptimization : public ParamServer {
 
   void getDetections() {
     detectionIsActive          = false;
-    detectionSrv.request.cloud = cloudInfo.cloud_raw;
+    detectionSrv.request.cloud = readRawCloud(cloudInfo, lidarFrame);
     if (detectionClient.call(detectionSrv)) {
       *detections       = detectionSrv.response.detections;
       detectionIsActive = true;
@@ -562,13 +668,6 @@ class mapOptimization : public ParamServer {
     gpsQueue.push_back(*gpsMsg);
   }
 
-  void pointAssociateToMap(PointType const* const pi, PointType* const po) {
-    po->x         = transPointAssociateToMap(0, 0) * pi->x + transPointAssociateToMap(0, 1) * pi->y + transPointAssociateToMap(0, 2) * pi->z + transPointAssociateToMap(0, 3);
-    po->y         = transPointAssociateToMap(1, 0) * pi->x + transPointAssociateToMap(1, 1) * pi->y + transPointAssociateToMap(1, 2) * pi->z + transPointAssociateToMap(1, 3);
-    po->z         = transPointAssociateToMap(2, 0) * pi->x + transPointAssociateToMap(2, 1) * pi->y + transPointAssociateToMap(2, 2) * pi->z + transPointAssociateToMap(2, 3);
-    po->intensity = pi->intensity;
-  }
-
   pcl::PointCloud<PointType>::Ptr transformPointCloud(pcl::PointCloud<PointType>::Ptr cloudIn, PointTypePose* transformIn) {
     pcl::PointCloud<PointType>::Ptr cloudOut(new pcl::PointCloud<PointType>());
 
@@ -577,14 +676,10 @@ class mapOptimization : public ParamServer {
 
     Eigen::Affine3f transCur = pcl::getTransformation(transformIn->x, transformIn->y, transformIn->z, transformIn->roll, transformIn->pitch, transformIn->yaw);
 
+    const int blockSize = 1024;
 #pragma omp parallel for num_threads(numberOfCores)
-    for (int i = 0; i < cloudSize; ++i) {
-      const auto& pointFrom         = cloudIn->points[i];
-      cloudOut->points[i].x         = transCur(0, 0) * pointFrom.x + transCur(0, 1) * pointFrom.y + transCur(0, 2) * pointFrom.z + transCur(0, 3);
-      cloudOut->points[i].y         = transCur(1, 0) * pointFrom.x + transCur(1, 1) * pointFrom.y + transCur(1, 2) * pointFrom.z + transCur(1, 3);
-      cloudOut->points[i].z         = transCur(2, 0) * pointFrom.x + transCur(2, 1) * pointFrom.y + transCur(2, 2) * pointFrom.z + transCur(2, 3);
-      cloudOut->points[i].intensity = pointFrom.intensity;
-    }
+    for (int i = 0; i < cloudSize; i += blockSize)
+      transformPoints(&cloudIn->points[i], &cloudOut->points[i], std::min(blockSize, cloudSize - i), transCur);
     return cloudOut;
   }
 
@@ -748,33 +843,32 @@ class mapOptimization : public ParamServer {
     if (cloudKeyPoses3D->points.empty() == true)
       return;
 
-    pcl::KdTreeFLANN<PointType>::Ptr kdtreeGlobalMap(new pcl::KdTreeFLANN<PointType>());
-    ;
     pcl::PointCloud<PointType>::Ptr globalMapKeyPoses(new pcl::PointCloud<PointType>());
     pcl::PointCloud<PointType>::Ptr globalMapKeyPosesDS(new pcl::PointCloud<PointType>());
     pcl::PointCloud<PointType>::Ptr globalMapKeyFrames(new pcl::PointCloud<PointType>());
     pcl::PointCloud<PointType>::Ptr globalMapKeyFramesDS(new pcl::PointCloud<PointType>());
 
     // kd-tree to find near key frames to visualize
-    std::vector<int> pointSearchIndGlobalMap;
+    std::vector<PointType> pointSearchGlobalMap;
     std::vector<float> pointSearchSqDisGlobalMap;
     // search near key frames to visualize
     mtx.lock();
-    kdtreeGlobalMap->setInputCloud(cloudKeyPoses3D);
-    kdtreeGlobalMap->radiusSearch(cloudKeyPoses3D->back(), globalMapVisualizationSearchRadius, pointSearchIndGlobalMap, pointSearchSqDisGlobalMap, 0);
+    keyPoseIndex.radiusSearch(cloudKeyPoses3D->back(), globalMapVisualizationSearchRadius, pointSearchGlobalMap, pointSearchSqDisGlobalMap);
     mtx.unlock();
 
-    for (int i = 0; i < (int)pointSearchIndGlobalMap.size(); ++i)
-      globalMapKeyPoses->push_back(cloudKeyPoses3D->points[pointSearchIndGlobalMap[i]]);
+    for (int i = 0; i < (int)pointSearchGlobalMap.size(); ++i)
+      globalMapKeyPoses->push_back(pointSearchGlobalMap[i]);
     // downsample near selected key frames
     pcl::VoxelGrid<PointType> downSizeFilterGlobalMapKeyPoses;                                                                                             // for global map visualization
     downSizeFilterGlobalMapKeyPoses.setLeafSize(globalMapVisualizationPoseDensity, globalMapVisualizationPoseDensity, globalMapVisualizationPoseDensity);  // for global map visualization
     downSizeFilterGlobalMapKeyPoses.setInputCloud(globalMapKeyPoses);
     downSizeFilterGlobalMapKeyPoses.filter(*globalMapKeyPosesDS);
+    mtx.lock();
     for (auto& pt : globalMapKeyPosesDS->points) {
-      kdtreeGlobalMap->nearestKSearch(pt, 1, pointSearchIndGlobalMap, pointSearchSqDisGlobalMap);
-      pt.intensity = cloudKeyPoses3D->points[pointSearchIndGlobalMap[0]].intensity;
+      keyPoseIndex.nearestKSearch(pt, 1, pointSearchGlobalMap, pointSearchSqDisGlobalMap);
+      pt.intensity = pointSearchGlobalMap[0].intensity;
     }
+    mtx.unlock();
 
     // extract visualized and downsampled key frames
     for (int i = 0; i < (int)globalMapKeyPosesDS->size(); ++i) {
@@ -819,16 +913,21 @@ class mapOptimization : public ParamServer {
     if (cloudKeyPoses3D->points.empty() == true)
       return;
 
+    // the history key frames around the latest one are searched along with the copy: the
+    // index holds the key poses of the copy only until correctPoses() moves them
+    std::vector<PointType> pointSearchLoop;
+    std::vector<float> pointSearchSqDisLoop;
     mtx.lock();
     *copy_cloudKeyPoses3D = *cloudKeyPoses3D;
     *copy_cloudKeyPoses6D = *cloudKeyPoses6D;
+    keyPoseIndex.radiusSearch(copy_cloudKeyPoses3D->back(), historyKeyframeSearchRadius, pointSearchLoop, pointSearchSqDisLoop);
     mtx.unlock();
 
     // find keys
     int loopKeyCur;
     int loopKeyPre;
     if (detectLoopClosureExternal(&loopKeyCur, &loopKeyPre) == false)
-      if (detectLoopClosureDistance(&loopKeyCur, &loopKeyPre) == false)
+      if (detectLoopClosureDistance(pointSearchLoop, &loopKeyCur, &loopKeyPre) == false)
         return;
 
     // extract cloud
@@ -894,7 +993,8 @@ class mapOptimization : public ParamServer {
     loopIndexContainer[loopKeyCur] = loopKeyPre;
   }
 
-  bool detectLoopClosureDistance(int* latestID, int* closestID) {
+  /** Loop closure with the closest history key frame among ``pointSearchLoop`` (sorted by distance) */
+  bool detectLoopClosureDistance(const std::vector<PointType>& pointSearchLoop, int* latestID, int* closestID) {
     int loopKeyCur = copy_cloudKeyPoses3D->size() - 1;
     int loopKeyPre = -1;
 
@@ -904,13 +1004,8 @@ class mapOptimization : public ParamServer {
       return false;
 
     // find the closest history key frame
-    std::vector<int> pointSearchIndLoop;
-    std::vector<float> pointSearchSqDisLoop;
-    kdtreeHistoryKeyPoses->setInputCloud(copy_cloudKeyPoses3D);
-    kdtreeHistoryKeyPoses->radiusSearch(copy_cloudKeyPoses3D->back(), historyKeyframeSearchRadius, pointSearchIndLoop, pointSearchSqDisLoop, 0);
-
-    for (int i = 0; i < (int)pointSearchIndLoop.size(); ++i) {
-      int id = pointSearchIndLoop[i];
+    for (int i = 0; i < (int)pointSearchLoop.size(); ++i) {
+      int id = (int)pointSearchLoop[i].intensity;
       if (abs(copy_cloudKeyPoses6D->points[id].time - timeLaserInfoCur) > historyKeyframeSearchTimeDiff) {
         loopKeyPre = id;
         break;
@@ -1128,22 +1223,19 @@ class mapOptimization : public ParamServer {
   void extractNearby() {
     pcl::PointCloud<PointType>::Ptr surroundingKeyPoses(new pcl::PointCloud<PointType>());
     pcl::PointCloud<PointType>::Ptr surroundingKeyPosesDS(new pcl::PointCloud<PointType>());
-    std::vector<int> pointSearchInd;
+    std::vector<PointType> pointSearch;
     std::vector<float> pointSearchSqDis;
 
     // extract all the nearby key poses and downsample them
-    kdtreeSurroundingKeyPoses->setInputCloud(cloudKeyPoses3D);  // create kd-tree
-    kdtreeSurroundingKeyPoses->radiusSearch(cloudKeyPoses3D->back(), (double)surroundingKeyframeSearchRadius, pointSearchInd, pointSearchSqDis);
-    for (int i = 0; i < (int)pointSearchInd.size(); ++i) {
-      int id = pointSearchInd[i];
-      surroundingKeyPoses->push_back(cloudKeyPoses3D->points[id]);
-    }
+    keyPoseIndex.radiusSearch(cloudKeyPoses3D->back(), surroundingKeyframeSearchRadius, pointSearch, pointSearchSqDis);
+    for (int i = 0; i < (int)pointSearch.size(); ++i)
+      surroundingKeyPoses->push_back(pointSearch[i]);
 
     downSizeFilterSurroundingKeyPoses.setInputCloud(surroundingKeyPoses);
     downSizeFilterSurroundingKeyPoses.filter(*surroundingKeyPosesDS);
     for (auto& pt : surroundingKeyPosesDS->points) {
-      kdtreeSurroundingKeyPoses->nearestKSearch(pt, 1, pointSearchInd, pointSearchSqDis);
-      pt.intensity = cloudKeyPoses3D->points[pointSearchInd[0]].intensity;
+      keyPoseIndex.nearestKSearch(pt, 1, pointSearch, pointSearchSqDis);
+      pt.intensity = pointSearch[0].intensity;
     }
 
     // also extract some latest key frames in case the robot rotates in one position
@@ -1158,41 +1250,82 @@ class mapOptimization : public ParamServer {
     extractCloud(surroundingKeyPosesDS);
   }
 
+  const pair<pcl::PointCloud<PointType>, pcl::PointCloud<PointType>>& getTransformedKeyFrame(int thisKeyInd) {
+    auto cached = laserCloudMapContainer.get(thisKeyInd);
+    if (cached != nullptr)
+      return *cached;  // transformed cloud available
+
+    // transformed cloud not available
+    pcl::PointCloud<PointType> laserCloudCornerTemp = *transformPointCloud(cornerCloudKeyFrames[thisKeyInd], &cloudKeyPoses6D->points[thisKeyInd]);
+    pcl::PointCloud<PointType> laserCloudSurfTemp   = *transformPointCloud(surfCloudKeyFrames[thisKeyInd], &cloudKeyPoses6D->points[thisKeyInd]);
+    size_t bytes                                    = (laserCloudCornerTemp.size() + laserCloudSurfTemp.size()) * sizeof(PointType);
+    return laserCloudMapContainer.put(thisKeyInd, make_pair(std::move(laserCloudCornerTemp), std::move(laserCloudSurfTemp)), bytes);
+  }
+
+  void invalidateKeyFrame(int thisKeyInd) {
+    // take the key frame out of the local map while its cached cloud still
+    // matches the inserted one; extractCloud adds it back with the new pose
+    if (keyFramesInMap.erase(thisKeyInd) > 0) {
+      const auto& keyFrame = getTransformedKeyFrame(thisKeyInd);
+      voxelMapCornerFromMap.remove(keyFrame.first.points);
+      voxelMapSurfFromMap.remove(keyFrame.second.points);
+    }
+    laserCloudMapContainer.erase(thisKeyInd);
+  }
+
   void extractCloud(pcl::PointCloud<PointType>::Ptr cloudToExtract) {
-    // fuse the map
-    laserCloudCornerFromMap->clear();
-    laserCloudSurfFromMap->clear();
+    std::set<int> keyFramesToExtract;
     for (int i = 0; i < (int)cloudToExtract->size(); ++i) {
       if (pointDistance(cloudToExtract->points[i], cloudKeyPoses3D->back()) > surroundingKeyframeSearchRadius)
         continue;
-
-      int thisKeyInd = (int)cloudToExtract->points[i].intensity;
-      if (laserCloudMapContainer.find(thisKeyInd) != laserCloudMapContainer.end()) {
-        // transformed cloud available
-        *laserCloudCornerFromMap += laserCloudMapContainer[thisKeyInd].first;
-        *laserCloudSurfFromMap += laserCloudMapContainer[thisKeyInd].second;
-      } else {
-        // transformed cloud not available
-        pcl::PointCloud<PointType> laserCloudCornerTemp = *transformPointCloud(cornerCloudKeyFrames[thisKeyInd], &cloudKeyPoses6D->points[thisKeyInd]);
-        pcl::PointCloud<PointType> laserCloudSurfTemp   = *transformPointCloud(surfCloudKeyFrames[thisKeyInd], &cloudKeyPoses6D->points[thisKeyInd]);
-        *laserCloudCornerFromMap += laserCloudCornerTemp;
-        *laserCloudSurfFromMap += laserCloudSurfTemp;
-        laserCloudMapContainer[thisKeyInd] = make_pair(laserCloudCornerTemp, laserCloudSurfTemp);
-      }
+      keyFramesToExtract.insert((int)cloudToExtract->points[i].intensity);
     }
 
-    // Downsample the surrounding corner key frames (or map)
-    downSizeFilterCorner.setInputCloud(laserCloudCornerFromMap);
-    downSizeFilterCorner.filter(*laserCloudCornerFromMapDS);
-    laserCloudCornerFromMapDSNum = laserCloudCornerFromMapDS->size();
-    // Downsample the surrounding surf key frames (or map)
-    downSizeFilterSurf.setInputCloud(laserCloudSurfFromMap);
-    downSizeFilterSurf.filter(*laserCloudSurfFromMapDS);
-    laserCloudSurfFromMapDSNum = laserCloudSurfFromMapDS->size();
-
-    // clear map cache if too large
-    if (laserCloudMapContainer.size() > 1000)
-      laserCloudMapContainer.clear();
+    // only touch the key frames that leave or enter the surrounding window;
+    // the transformed clouds are bit-identical to the added ones as long as
+    // the key poses are unchanged, so they can be removed exactly
+    for (int thisKeyInd : keyFramesInMap) {
+      if (keyFramesToExtract.count(thisKeyInd) > 0)
+        continue;
+      const auto& keyFrame = getTransformedKeyFrame(thisKeyInd);
+      voxelMapCornerFromMap.remove(keyFrame.first.points);
+      voxelMapSurfFromMap.remove(keyFrame.second.points);
+    }
+    for (int thisKeyInd : keyFramesToExtract) {
+      if (keyFramesInMap.count(thisKeyInd) > 0)
+        continue;
+      const auto& keyFrame = getTransformedKeyFrame(thisKeyInd);
+      voxelMapCornerFromMap.insert(keyFrame.first.points);
+      voxelMapSurfFromMap.insert(keyFrame.second.points);
+    }
+    keyFramesInMap.swap(keyFramesToExtract);
+
+    // refresh the voxel centroids (or downsampled map)
+    std::vector<PointType> cornerRemoved, cornerAdded, surfRemoved, surfAdded;
+    voxelMapCornerFromMap.commit(cornerRemoved, cornerAdded);
+    voxelMapSurfFromMap.commit(surfRemoved, surfAdded);
+    if (mappingBackend == MapBackendType::IKDTREE) {
+      // patch the trees with the centroids that changed
+      ikdtreeCornerFromMap.remove(cornerRemoved);
+      ikdtreeCornerFromMap.insert(cornerAdded);
+      ikdtreeSurfFromMap.remove(surfRemoved);
+      ikdtreeSurfFromMap.insert(surfAdded);
+    } else if (mappingBackend == MapBackendType::VOXEL) {
+      // refit the line/plane models of the voxels whose points changed
+      voxelFeatureMapCorner.remove(cornerRemoved);
+      voxelFeatureMapCorner.insert(cornerAdded);
+      voxelFeatureMapCorner.update();
+      voxelFeatureMapSurf.remove(surfRemoved);
+      voxelFeatureMapSurf.insert(surfAdded);
+      voxelFeatureMapSurf.update();
+    } else {
+      laserCloudCornerFromMapDS->clear();
+      voxelMapCornerFromMap.flatten(*laserCloudCornerFromMapDS);
+      laserCloudSurfFromMapDS->clear();
+      voxelMapSurfFromMap.flatten(*laserCloudSurfFromMapDS);
+    }
+    laserCloudCornerFromMapDSNum = voxelMapCornerFromMap.size();
+    laserCloudSurfFromMapDSNum   = voxelMapSurfFromMap.size();
   }
 
   void extractSurroundingKeyFrames() {
@@ -1226,202 +1359,298 @@ class mapOptimization : public ParamServer {
     transPointAssociateToMap = trans2Affine3f(transformTobeMapped);
   }
 
+  void searchNearestFromMap(const PointType& pointSel,
+                            const pcl::KdTreeFLANN<PointType>::Ptr& kdtreeFromMap,
+                            const pcl::PointCloud<PointType>::Ptr& laserCloudFromMapDS,
+                            const IncrementalKdTree<PointType>& ikdtreeFromMap,
+                            std::vector<PointType>& pointSearch,
+                            std::vector<float>& pointSearchSqDis) {
+    if (mappingBackend == MapBackendType::IKDTREE) {
+      ikdtreeFromMap.nearestKSearch(pointSel, 5, pointSearch, pointSearchSqDis);
+      return;
+    }
+
+    std::vector<int> pointSearchInd;
+    kdtreeFromMap->nearestKSearch(pointSel, 5, pointSearchInd, pointSearchSqDis);
+    pointSearch.resize(pointSearchInd.size());
+    for (int j = 0; j < (int)pointSearchInd.size(); ++j)
+      pointSearch[j] = laserCloudFromMapDS->points[pointSearchInd[j]];
+  }
+
+  bool findLine(const PointType& pointSel, Eigen::Vector3f& center, Eigen::Vector3f& direction) {
+    if (mappingBackend == MapBackendType::VOXEL) {
+      const VoxelFeatureModel* model = voxelFeatureMapCorner.find(pointSel);
+      if (model == nullptr || !model->lineValid)
+        return false;
+      center    = model->center;
+      direction = model->direction;
+      return true;
+    }
+
+    std::vector<PointType> pointSearch;
+    std::vector<float> pointSearchSqDis;
+    searchNearestFromMap(pointSel, kdtreeCornerFromMap, laserCloudCornerFromMapDS, ikdtreeCornerFromMap, pointSearch, pointSearchSqDis);
+    if (pointSearchSqDis.size() < 5 || pointSearchSqDis[4] >= 1.0)
+      return false;
+
+    cv::Mat matA1(3, 3, CV_32F, cv::Scalar::all(0));
+    cv::Mat matD1(1, 3, CV_32F, cv::Scalar::all(0));
+    cv::Mat matV1(3, 3, CV_32F, cv::Scalar::all(0));
+
+    float cx = 0, cy = 0, cz = 0;
+    for (int j = 0; j < 5; j++) {
+      cx += pointSearch[j].x;
+      cy += pointSearch[j].y;
+      cz += pointSearch[j].z;
+    }
+    cx /= 5;
+    cy /= 5;
+    cz /= 5;
+
+    float a11 = 0, a12 = 0, a13 = 0, a22 = 0, a23 = 0, a33 = 0;
+    for (int j = 0; j < 5; j++) {
+      float ax = pointSearch[j].x - cx;
+      float ay = pointSearch[j].y - cy;
+      float az = pointSearch[j].z - cz;
+
+      a11 += ax * ax;
+      a12 += ax * ay;
+      a13 += ax * az;
+      a22 += ay * ay;
+      a23 += ay * az;
+      a33 += az * az;
+    }
+    a11 /= 5;
+    a12 /= 5;
+    a13 /= 5;
+    a22 /= 5;
+    a23 /= 5;
+    a33 /= 5;
+
+    matA1.at<float>(0, 0) = a11;
+    matA1.at<float>(0, 1) = a12;
+    matA1.at<float>(0, 2) = a13;
+    matA1.at<float>(1, 0) = a12;
+    matA1.at<float>(1, 1) = a22;
+    matA1.at<float>(1, 2) = a23;
+    matA1.at<float>(2, 0) = a13;
+    matA1.at<float>(2, 1) = a23;
+    matA1.at<float>(2, 2) = a33;
+
+    cv::eigen(matA1, matD1, matV1);
+
+    center    = Eigen::Vector3f(cx, cy, cz);
+    direction = Eigen::Vector3f(matV1.at<float>(0, 0), matV1.at<float>(0, 1), matV1.at<float>(0, 2));
+    return matD1.at<float>(0, 0) > 3 * matD1.at<float>(0, 1);
+  }
+
+  bool lineCoefficients(const PointType& pointSel, const Eigen::Vector3f& center, const Eigen::Vector3f& direction, PointType& coeff) {
+    float x0 = pointSel.x;
+    float y0 = pointSel.y;
+    float z0 = pointSel.z;
+    float x1 = center(0) + 0.1 * direction(0);
+    float y1 = center(1) + 0.1 * direction(1);
+    float z1 = center(2) + 0.1 * direction(2);
+    float x2 = center(0) - 0.1 * direction(0);
+    float y2 = center(1) - 0.1 * direction(1);
+    float z2 = center(2) - 0.1 * direction(2);
+
+    // clang-format off
+    float a012 = sqrt(((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1)) * ((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1))
+                    + ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1)) * ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1))
+                    + ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1)) * ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1)));
+
+    float l12 = sqrt((x1 - x2) * (x1 - x2) + (y1 - y2) * (y1 - y2) + (z1 - z2) * (z1 - z2));
+
+    float la = ((y1 - y2) * ((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1))
+              + (z1 - z2) * ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1))) / a012 / l12;
+
+    float lb = -((x1 - x2) * ((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1)) 
+               - (z1 - z2) * ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1))) / a012 / l12;
+
+    float lc = -((x1 - x2) * ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1))
+               + (y1 - y2) * ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1))) / a012 / l12;
+    // clang-format on
+
+    float ld2 = a012 / l12;
+
+    float s = 1 - 0.9 * fabs(ld2);
+
+    coeff.x         = s * la;
+    coeff.y         = s * lb;
+    coeff.z         = s * lc;
+    coeff.intensity = s * ld2;
+
+    return s > 0.1;
+  }
+
+  bool findPlane(const PointType& pointSel, Eigen::Vector4f& plane) {
+    if (mappingBackend == MapBackendType::VOXEL) {
+      const VoxelFeatureModel* model = voxelFeatureMapSurf.find(pointSel);
+      if (model == nullptr || !model->planeValid)
+        return false;
+      plane << model->normal, -model->normal.dot(model->center);
+      return true;
+    }
+
+    std::vector<PointType> pointSearch;
+    std::vector<float> pointSearchSqDis;
+    searchNearestFromMap(pointSel, kdtreeSurfFromMap, laserCloudSurfFromMapDS, ikdtreeSurfFromMap, pointSearch, pointSearchSqDis);
+    if (pointSearchSqDis.size() < 5 || pointSearchSqDis[4] >= 1.0)
+      return false;
+
+    Eigen::Matrix<float, 5, 3> matA0;
+    Eigen::Matrix<float, 5, 1> matB0;
+    Eigen::Vector3f matX0;
+
+    matA0.setZero();
+    matB0.fill(-1);
+    matX0.setZero();
+
+    for (int j = 0; j < 5; j++) {
+      matA0(j, 0) = pointSearch[j].x;
+      matA0(j, 1) = pointSearch[j].y;
+      matA0(j, 2) = pointSearch[j].z;
+    }
+
+    matX0 = matA0.colPivHouseholderQr().solve(matB0);
+
+    float pa = matX0(0, 0);
+    float pb = matX0(1, 0);
+    float pc = matX0(2, 0);
+    float pd = 1;
+
+    float ps = sqrt(pa * pa + pb * pb + pc * pc);
+    pa /= ps;
+    pb /= ps;
+    pc /= ps;
+    pd /= ps;
+
+    for (int j = 0; j < 5; j++) {
+      if (fabs(pa * pointSearch[j].x +
+               pb * pointSearch[j].y +
+               pc * pointSearch[j].z + pd) > 0.2) {
+        return false;
+      }
+    }
+
+    plane = Eigen::Vector4f(pa, pb, pc, pd);
+    return true;
+  }
+
+  bool planeCoefficients(const PointType& pointSel, const Eigen::Vector4f& plane, PointType& coeff) {
+    float pa = plane(0);
+    float pb = plane(1);
+    float pc = plane(2);
+    float pd = plane(3);
+
+    float pd2 = pa * pointSel.x + pb * pointSel.y + pc * pointSel.z + pd;
+
+    float s = 1 - 0.9 * fabs(pd2) / sqrt(sqrt(pointSel.x * pointSel.x + pointSel.y * pointSel.y + pointSel.z * pointSel.z));
+
+    coeff.x         = s * pa;
+    coeff.y         = s * pb;
+    coeff.z         = s * pc;
+    coeff.intensity = s * pd2;
+
+    return s > 0.1;
+  }
+
+  const FeatureCorrespondence& searchCornerCorrespondence(int i, const PointType& pointSel, int& searchCount) {
+    FeatureCorrespondence& correspondence = cornerCorrespondences[i];
+    if (!correspondence.reusableAt(pointSel, mappingCorrespondenceReuseDistance)) {
+      correspondence.valid = findLine(pointSel, correspondence.center, correspondence.direction);
+      correspondence.setSearchedAt(pointSel);
+      ++searchCount;
+    }
+    return correspondence;
+  }
+
+  const FeatureCorrespondence& searchSurfCorrespondence(int i, const PointType& pointSel, int& searchCount) {
+    FeatureCorrespondence& correspondence = surfCorrespondences[i];
+    if (!correspondence.reusableAt(pointSel, mappingCorrespondenceReuseDistance)) {
+      correspondence.valid = findPlane(pointSel, correspondence.plane);
+      correspondence.setSearchedAt(pointSel);
+      ++searchCount;
+    }
+    return correspondence;
+  }
+
   void cornerOptimization() {
     updatePointAssociateToMap();
+    transformPoints(laserCloudCornerLastDS->points.data(), laserCloudSelCornerVec.data(), laserCloudCornerLastDSNum, transPointAssociateToMap);
 
-#pragma omp parallel for num_threads(numberOfCores)
+    int searchCount = 0;
+#pragma omp parallel for num_threads(numberOfCores) reduction(+ : searchCount)
     for (int i = 0; i < laserCloudCornerLastDSNum; i++) {
       PointType pointOri, pointSel, coeff;
-      std::vector<int> pointSearchInd;
-      std::vector<float> pointSearchSqDis;
-
-      pointOri = laserCloudCornerLastDS->points[i];
-      pointAssociateToMap(&pointOri, &pointSel);
-      kdtreeCornerFromMap->nearestKSearch(pointSel, 5, pointSearchInd, pointSearchSqDis);
-
-      cv::Mat matA1(3, 3, CV_32F, cv::Scalar::all(0));
-      cv::Mat matD1(1, 3, CV_32F, cv::Scalar::all(0));
-      cv::Mat matV1(3, 3, CV_32F, cv::Scalar::all(0));
-
-      if (pointSearchSqDis[4] < 1.0) {
-        float cx = 0, cy = 0, cz = 0;
-        for (int j = 0; j < 5; j++) {
-          cx += laserCloudCornerFromMapDS->points[pointSearchInd[j]].x;
-          cy += laserCloudCornerFromMapDS->points[pointSearchInd[j]].y;
-          cz += laserCloudCornerFromMapDS->points[pointSearchInd[j]].z;
-        }
-        cx /= 5;
-        cy /= 5;
-        cz /= 5;
-
-        float a11 = 0, a12 = 0, a13 = 0, a22 = 0, a23 = 0, a33 = 0;
-        for (int j = 0; j < 5; j++) {
-          float ax = laserCloudCornerFromMapDS->points[pointSearchInd[j]].x - cx;
-          float ay = laserCloudCornerFromMapDS->points[pointSearchInd[j]].y - cy;
-          float az = laserCloudCornerFromMapDS->points[pointSearchInd[j]].z - cz;
-
-          a11 += ax * ax;
-          a12 += ax * ay;
-          a13 += ax * az;
-          a22 += ay * ay;
-          a23 += ay * az;
-          a33 += az * az;
-        }
-        a11 /= 5;
-        a12 /= 5;
-        a13 /= 5;
-        a22 /= 5;
-        a23 /= 5;
-        a33 /= 5;
-
-        matA1.at<float>(0, 0) = a11;
-        matA1.at<float>(0, 1) = a12;
-        matA1.at<float>(0, 2) = a13;
-        matA1.at<float>(1, 0) = a12;
-        matA1.at<float>(1, 1) = a22;
-        matA1.at<float>(1, 2) = a23;
-        matA1.at<float>(2, 0) = a13;
-        matA1.at<float>(2, 1) = a23;
-        matA1.at<float>(2, 2) = a33;
-
-        cv::eigen(matA1, matD1, matV1);
-
-        if (matD1.at<float>(0, 0) > 3 * matD1.at<float>(0, 1)) {
-          float x0 = pointSel.x;
-          float y0 = pointSel.y;
-          float z0 = pointSel.z;
-          float x1 = cx + 0.1 * matV1.at<float>(0, 0);
-          float y1 = cy + 0.1 * matV1.at<float>(0, 1);
-          float z1 = cz + 0.1 * matV1.at<float>(0, 2);
-          float x2 = cx - 0.1 * matV1.at<float>(0, 0);
-          float y2 = cy - 0.1 * matV1.at<float>(0, 1);
-          float z2 = cz - 0.1 * matV1.at<float>(0, 2);
-
-          // clang-format off
-          float a012 = sqrt(((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1)) * ((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1))
-                          + ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1)) * ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1))
-                          + ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1)) * ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1)));
-
-          float l12 = sqrt((x1 - x2) * (x1 - x2) + (y1 - y2) * (y1 - y2) + (z1 - z2) * (z1 - z2));
-
-          float la = ((y1 - y2) * ((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1))
-                    + (z1 - z2) * ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1))) / a012 / l12;
-
-          float lb = -((x1 - x2) * ((x0 - x1) * (y0 - y2) - (x0 - x2) * (y0 - y1)) 
-                     - (z1 - z2) * ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1))) / a012 / l12;
-
-          float lc = -((x1 - x2) * ((x0 - x1) * (z0 - z2) - (x0 - x2) * (z0 - z1))
-                     + (y1 - y2) * ((y0 - y1) * (z0 - z2) - (y0 - y2) * (z0 - z1))) / a012 / l12;
-          // clang-format on
-
-          float ld2 = a012 / l12;
-
-          float s = 1 - 0.9 * fabs(ld2);
-
-          coeff.x         = s * la;
-          coeff.y         = s * lb;
-          coeff.z         = s * lc;
-          coeff.intensity = s * ld2;
-
-          if (s > 0.1) {
-            laserCloudOriCornerVec[i]  = pointOri;
-            coeffSelCornerVec[i]       = coeff;
-            laserCloudOriCornerFlag[i] = true;
-          }
-        }
-      }
+
+      pointOri                                    = laserCloudCornerLastDS->points[i];
+      pointSel                                    = laserCloudSelCornerVec[i];
+      const FeatureCorrespondence& correspondence = searchCornerCorrespondence(i, pointSel, searchCount);
+      if (!correspondence.valid)
+        continue;
+
+      if (lineCoefficients(pointSel, correspondence.center, correspondence.direction, coeff))
+        residuals.set(i, pointOri, coeff);
     }
+    numberOfCorrespondenceSearches += searchCount;
   }
 
   void surfOptimization() {
     updatePointAssociateToMap();
+    transformPoints(laserCloudSurfLastDS->points.data(), laserCloudSelSurfVec.data(), laserCloudSurfLastDSNum, transPointAssociateToMap);
 
-#pragma omp parallel for num_threads(numberOfCores)
+    int searchCount = 0;
+#pragma omp parallel for num_threads(numberOfCores) reduction(+ : searchCount)
     for (int i = 0; i < laserCloudSurfLastDSNum; i++) {
       PointType pointOri, pointSel, coeff;
-      std::vector<int> pointSearchInd;
-      std::vector<float> pointSearchSqDis;
-
-      pointOri = laserCloudSurfLastDS->points[i];
-      pointAssociateToMap(&pointOri, &pointSel);
-      kdtreeSurfFromMap->nearestKSearch(pointSel, 5, pointSearchInd, pointSearchSqDis);
-
-      Eigen::Matrix<float, 5, 3> matA0;
-      Eigen::Matrix<float, 5, 1> matB0;
-      Eigen::Vector3f matX0;
-
-      matA0.setZero();
-      matB0.fill(-1);
-      matX0.setZero();
-
-      if (pointSearchSqDis[4] < 1.0) {
-        for (int j = 0; j < 5; j++) {
-          matA0(j, 0) = laserCloudSurfFromMapDS->points[pointSearchInd[j]].x;
-          matA0(j, 1) = laserCloudSurfFromMapDS->points[pointSearchInd[j]].y;
-          matA0(j, 2) = laserCloudSurfFromMapDS->points[pointSearchInd[j]].z;
-        }
-
-        matX0 = matA0.colPivHouseholderQr().solve(matB0);
-
-        float pa = matX0(0, 0);
-        float pb = matX0(1, 0);
-        float pc = matX0(2, 0);
-        float pd = 1;
-
-        float ps = sqrt(pa * pa + pb * pb + pc * pc);
-        pa /= ps;
-        pb /= ps;
-        pc /= ps;
-        pd /= ps;
-
-        bool planeValid = true;
-        for (int j = 0; j < 5; j++) {
-          if (fabs(pa * laserCloudSurfFromMapDS->points[pointSearchInd[j]].x +
-                   pb * laserCloudSurfFromMapDS->points[pointSearchInd[j]].y +
-                   pc * laserCloudSurfFromMapDS->points[pointSearchInd[j]].z + pd) > 0.2) {
-            planeValid = false;
-            break;
-          }
-        }
-
-        if (planeValid) {
-          float pd2 = pa * pointSel.x + pb * pointSel.y + pc * pointSel.z + pd;
-
-          float s = 1 - 0.9 * fabs(pd2) / sqrt(sqrt(pointSel.x * pointSel.x + pointSel.y * pointSel.y + pointSel.z * pointSel.z));
 
-          coeff.x         = s * pa;
-          coeff.y         = s * pb;
-          coeff.z         = s * pc;
-          coeff.intensity = s * pd2;
+      pointOri                                    = laserCloudSurfLastDS->points[i];
+      pointSel                                    = laserCloudSelSurfVec[i];
+      const FeatureCorrespondence& correspondence = searchSurfCorrespondence(i, pointSel, searchCount);
+      if (!correspondence.valid)
+        continue;
 
-          if (s > 0.1) {
-            laserCloudOriSurfVec[i]  = pointOri;
-            coeffSelSurfVec[i]       = coeff;
-            laserCloudOriSurfFlag[i] = true;
-          }
-        }
-      }
+      if (planeCoefficients(pointSel, correspondence.plane, coeff))
+        residuals.set(laserCloudCornerLastDSNum + i, pointOri, coeff);
     }
+    numberOfCorrespondenceSearches += searchCount;
   }
 
   void combineOptimizationCoeffs() {
-    // combine corner coeffs
-    for (int i = 0; i < laserCloudCornerLastDSNum; ++i) {
-      if (laserCloudOriCornerFlag[i] == true) {
-        laserCloudOri->push_back(laserCloudOriCornerVec[i]);
-        coeffSel->push_back(coeffSelCornerVec[i]);
-      }
-    }
-    // combine surf coeffs
-    for (int i = 0; i < laserCloudSurfLastDSNum; ++i) {
-      if (laserCloudOriSurfFlag[i] == true) {
-        laserCloudOri->push_back(laserCloudOriSurfVec[i]);
-        coeffSel->push_back(coeffSelSurfVec[i]);
-      }
-    }
-    // reset flag for next iteration
-    std::fill(laserCloudOriCornerFlag.begin(), laserCloudOriCornerFlag.end(), false);
-    std::fill(laserCloudOriSurfFlag.begin(), laserCloudOriSurfFlag.end(), false);
+    // move the valid corner and surf coeffs to the front
+    residuals.compact();
+  }
+
+  /** Row of the Jacobian (roll, pitch, yaw, x, y, z) and the right-hand side of one residual */
+  void jacobianRow(float srx, float crx, float sry, float cry, float srz, float crz,
+                   const PointType& point, const PointType& coeffIn, float* row, float* b) {
+    PointType pointOri, coeff;
+
+    // lidar -> camera
+    pointOri.x = point.y;
+    pointOri.y = point.z;
+    pointOri.z = point.x;
+    // lidar -> camera
+    coeff.x         = coeffIn.y;
+    coeff.y         = coeffIn.z;
+    coeff.z         = coeffIn.x;
+    coeff.intensity = coeffIn.intensity;
+    // in camera
+    float arx = (crx * sry * srz * pointOri.x + crx * crz * sry * pointOri.y - srx * sry * pointOri.z) * coeff.x + (-srx * srz * pointOri.x - crz * srx * pointOri.y - crx * pointOri.z) * coeff.y + (crx * cry * srz * pointOri.x + crx * cry * crz * pointOri.y - cry * srx * pointOri.z) * coeff.z;
+
+    float ary = ((cry * srx * srz - crz * sry) * pointOri.x + (sry * srz + cry * crz * srx) * pointOri.y + crx * cry * pointOri.z) * coeff.x + ((-cry * crz - srx * sry * srz) * pointOri.x + (cry * srz - crz * srx * sry) * pointOri.y - crx * sry * pointOri.z) * coeff.z;
+
+    float arz = ((crz * srx * sry - cry * srz) * pointOri.x + (-cry * crz - srx * sry * srz) * pointOri.y) * coeff.x + (crx * crz * pointOri.x - crx * srz * pointOri.y) * coeff.y + ((sry * srz + cry * crz * srx) * pointOri.x + (crz * sry - cry * srx * srz) * pointOri.y) * coeff.z;
+    // lidar -> camera
+    row[0] = arz;
+    row[1] = arx;
+    row[2] = ary;
+    row[3] = coeff.z;
+    row[4] = coeff.x;
+    row[5] = coeff.y;
+    *b     = -coeff.intensity;
   }
 
   bool LMOptimization(int iterCount) {
@@ -1442,7 +1671,7 @@ class mapOptimization : public ParamServer {
     float srz = sin(transformTobeMapped[0]);
     float crz = cos(transformTobeMapped[0]);
 
-    int laserCloudSelNum = laserCloudOri->size();
+    int laserCloudSelNum = residuals.size;
     if (laserCloudSelNum < 50) {
       return false;
     }
@@ -1452,39 +1681,111 @@ class mapOptimization : public ParamServer {
     cv::Mat matAtA(6, 6, CV_32F, cv::Scalar::all(0));
     cv::Mat matB(laserCloudSelNum, 1, CV_32F, cv::Scalar::all(0));
     cv::Mat matAtB(6, 1, CV_32F, cv::Scalar::all(0));
-    cv::Mat matX(6, 1, CV_32F, cv::Scalar::all(0));
 
     PointType pointOri, coeff;
 
     for (int i = 0; i < laserCloudSelNum; i++) {
-      // lidar -> camera
-      pointOri.x = laserCloudOri->points[i].y;
-      pointOri.y = laserCloudOri->points[i].z;
-      pointOri.z = laserCloudOri->points[i].x;
-      // lidar -> camera
-      coeff.x         = coeffSel->points[i].y;
-      coeff.y         = coeffSel->points[i].z;
-      coeff.z         = coeffSel->points[i].x;
-      coeff.intensity = coeffSel->points[i].intensity;
-      // in camera
-      float arx = (crx * sry * srz * pointOri.x + crx * crz * sry * pointOri.y - srx * sry * pointOri.z) * coeff.x + (-srx * srz * pointOri.x - crz * srx * pointOri.y - crx * pointOri.z) * coeff.y + (crx * cry * srz * pointOri.x + crx * cry * crz * pointOri.y - cry * srx * pointOri.z) * coeff.z;
-
-      float ary = ((cry * srx * srz - crz * sry) * pointOri.x + (sry * srz + cry * crz * srx) * pointOri.y + crx * cry * pointOri.z) * coeff.x + ((-cry * crz - srx * sry * srz) * pointOri.x + (cry * srz - crz * srx * sry) * pointOri.y - crx * sry * pointOri.z) * coeff.z;
-
-      float arz = ((crz * srx * sry - cry * srz) * pointOri.x + (-cry * crz - srx * sry * srz) * pointOri.y) * coeff.x + (crx * crz * pointOri.x - crx * srz * pointOri.y) * coeff.y + ((sry * srz + cry * crz * srx) * pointOri.x + (crz * sry - cry * srx * srz) * pointOri.y) * coeff.z;
-      // lidar -> camera
-      matA.at<float>(i, 0) = arz;
-      matA.at<float>(i, 1) = arx;
-      matA.at<float>(i, 2) = ary;
-      matA.at<float>(i, 3) = coeff.z;
-      matA.at<float>(i, 4) = coeff.x;
-      matA.at<float>(i, 5) = coeff.y;
-      matB.at<float>(i, 0) = -coeff.intensity;
+      pointOri.x      = residuals.x[i];
+      pointOri.y      = residuals.y[i];
+      pointOri.z      = residuals.z[i];
+      coeff.x         = residuals.coeffX[i];
+      coeff.y         = residuals.coeffY[i];
+      coeff.z         = residuals.coeffZ[i];
+      coeff.intensity = residuals.residual[i];
+      jacobianRow(srx, crx, sry, cry, srz, crz, pointOri, coeff, matA.ptr<float>(i), matB.ptr<float>(i));
     }
 
     cv::transpose(matA, matAt);
     matAtA = matAt * matA;
     matAtB = matAt * matB;
+
+    return solveLMStep(matAtA, matAtB, iterCount);
+  }
+
+  bool fusedLMOptimization(int iterCount) {
+    // correspondence search, residuals and normal equations in one pass, see LMOptimization()
+    updatePointAssociateToMap();
+    transformPoints(laserCloudCornerLastDS->points.data(), laserCloudSelCornerVec.data(), laserCloudCornerLastDSNum, transPointAssociateToMap);
+    transformPoints(laserCloudSurfLastDS->points.data(), laserCloudSelSurfVec.data(), laserCloudSurfLastDSNum, transPointAssociateToMap);
+
+    // lidar -> camera
+    float srx = sin(transformTobeMapped[1]);
+    float crx = cos(transformTobeMapped[1]);
+    float sry = sin(transformTobeMapped[2]);
+    float cry = cos(transformTobeMapped[2]);
+    float srz = sin(transformTobeMapped[0]);
+    float crz = cos(transformTobeMapped[0]);
+
+    threadNormalEquations.resize(numberOfCores);
+    for (NormalEquations& partial : threadNormalEquations)
+      partial.setZero();
+
+    int numberOfFeatures = laserCloudCornerLastDSNum + laserCloudSurfLastDSNum;
+    int searchCount      = 0;
+#pragma omp parallel num_threads(numberOfCores) reduction(+ : searchCount)
+    {
+      // per-thread partial sums, merged in thread order after the region so that the
+      // step does not depend on which thread finishes first
+      NormalEquations& partial = threadNormalEquations[omp_get_thread_num()];
+
+#pragma omp for schedule(static) nowait
+      for (int i = 0; i < numberOfFeatures; i++) {
+        PointType pointOri, pointSel, coeff;
+        bool valid;
+
+        if (i < laserCloudCornerLastDSNum) {
+          pointOri                                    = laserCloudCornerLastDS->points[i];
+          pointSel                                    = laserCloudSelCornerVec[i];
+          const FeatureCorrespondence& correspondence = searchCornerCorrespondence(i, pointSel, searchCount);
+          valid                                       = correspondence.valid && lineCoefficients(pointSel, correspondence.center, correspondence.direction, coeff);
+        } else {
+          int j                                       = i - laserCloudCornerLastDSNum;
+          pointOri                                    = laserCloudSurfLastDS->points[j];
+          pointSel                                    = laserCloudSelSurfVec[j];
+          const FeatureCorrespondence& correspondence = searchSurfCorrespondence(j, pointSel, searchCount);
+          valid                                       = correspondence.valid && planeCoefficients(pointSel, correspondence.plane, coeff);
+        }
+        if (!valid)
+          continue;
+
+        Eigen::Matrix<float, 6, 1> row;
+        float b;
+        jacobianRow(srx, crx, sry, cry, srz, crz, pointOri, coeff, row.data(), &b);
+        Eigen::Matrix<double, 6, 1> J = row.cast<double>();
+        partial.AtA.selfadjointView<Eigen::Upper>().rankUpdate(J);
+        partial.AtB += J * b;
+        ++partial.selNum;
+      }
+    }
+    numberOfCorrespondenceSearches += searchCount;
+
+    Eigen::Matrix<double, 6, 6> AtA = Eigen::Matrix<double, 6, 6>::Zero();
+    Eigen::Matrix<double, 6, 1> AtB = Eigen::Matrix<double, 6, 1>::Zero();
+    int laserCloudSelNum            = 0;
+    for (const NormalEquations& partial : threadNormalEquations) {
+      AtA += partial.AtA;
+      AtB += partial.AtB;
+      laserCloudSelNum += partial.selNum;
+    }
+
+    if (laserCloudSelNum < 50) {
+      return false;
+    }
+
+    Eigen::Matrix<double, 6, 6> AtAFull = AtA.selfadjointView<Eigen::Upper>();
+    cv::Mat matAtA(6, 6, CV_32F, cv::Scalar::all(0));
+    cv::Mat matAtB(6, 1, CV_32F, cv::Scalar::all(0));
+    for (int i = 0; i < 6; i++) {
+      for (int j = 0; j < 6; j++)
+        matAtA.at<float>(i, j) = AtAFull(i, j);
+      matAtB.at<float>(i, 0) = AtB(i);
+    }
+
+    return solveLMStep(matAtA, matAtB, iterCount);
+  }
+
+  bool solveLMStep(const cv::Mat& matAtA, const cv::Mat& matAtB, int iterCount) {
+    cv::Mat matX(6, 1, CV_32F, cv::Scalar::all(0));
     cv::solve(matAtA, matAtB, matX, cv::DECOMP_QR);
 
     if (iterCount == 0) {
@@ -1539,25 +1840,51 @@ class mapOptimization : public ParamServer {
   }
 
   void scan2MapOptimization() {
+    auto startTime                 = std::chrono::steady_clock::now();
+    numberOfIterations             = 0;
+    numberOfCorrespondenceSearches = 0;
+    scanToMapTime                  = 0;
+
     if (cloudKeyPoses3D->points.empty())
       return;
 
     if (laserCloudCornerLastDSNum > edgeFeatureMinValidNum && laserCloudSurfLastDSNum > surfFeatureMinValidNum) {
-      kdtreeCornerFromMap->setInputCloud(laserCloudCornerFromMapDS);
-      kdtreeSurfFromMap->setInputCloud(laserCloudSurfFromMapDS);
+      if (mappingBackend == MapBackendType::KDTREE) {
+        kdtreeCornerFromMap->setInputCloud(laserCloudCornerFromMapDS);
+        kdtreeSurfFromMap->setInputCloud(laserCloudSurfFromMapDS);
+      }
+
+      // correspondences are searched again in the first iteration
+      for (int i = 0; i < laserCloudCornerLastDSNum; i++)
+        cornerCorrespondences[i].searched = false;
+      for (int i = 0; i < laserCloudSurfLastDSNum; i++)
+        surfCorrespondences[i].searched = false;
+
+      for (int iterCount = 0; iterCount < mappingMaxIterations; iterCount++) {
+        ++numberOfIterations;
+        bool converged;
+        if (mappingFusedNormalEquations) {
+          converged = fusedLMOptimization(iterCount);
+        } else {
+          residuals.reset(laserCloudCornerLastDSNum + laserCloudSurfLastDSNum);
+
+          cornerOptimization();
+          surfOptimization();
 
-      for (int iterCount = 0; iterCount < 30; iterCount++) {
-        laserCloudOri->clear();
-        coeffSel->clear();
+          combineOptimizationCoeffs();
 
-        cornerOptimization();
-        surfOptimization();
+          converged = LMOptimization(iterCount);
+        }
 
-        combineOptimizationCoeffs();
+        if (converged == true)
+          break;
 
-        if (LMOptimization(iterCount) == true)
+        // stop early if the time budget of this scan is used up
+        scanToMapTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+        if (mappingTimeBudget > 0 && scanToMapTime > mappingTimeBudget)
           break;
       }
+      scanToMapTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
 
       transformUpdate();
     } else {
@@ -2335,6 +2662,7 @@ class mapOptimization : public ParamServer {
       thisPose3D.z         = latestEstimate.translation().z();
       thisPose3D.intensity = cloudKeyPoses3D->size();  // this can be used as index
       cloudKeyPoses3D->push_back(thisPose3D);
+      keyPoseIndex.insert(thisPose3D);
 
       thisPose6D.x         = thisPose3D.x;
       thisPose6D.y         = thisPose3D.y;
@@ -2441,33 +2769,52 @@ class mapOptimization : public ParamServer {
       return;
 
     if (aLoopIsClosed || anyObjectIsTightlyCoupled) {
-      // clear map cache
-      laserCloudMapContainer.clear();
-      // clear path
-      globalPath.poses.clear();
       // update key poses
       int numPoses = keyPoseIndices.size();
       for (int i = 0; i < numPoses; ++i) {
-        auto poseIndex               = keyPoseIndices[i];
-        cloudKeyPoses3D->points[i].x = isamCurrentEstimate.at<Pose3>(poseIndex).translation().x();
-        cloudKeyPoses3D->points[i].y = isamCurrentEstimate.at<Pose3>(poseIndex).translation().y();
-        cloudKeyPoses3D->points[i].z = isamCurrentEstimate.at<Pose3>(poseIndex).translation().z();
-
-        cloudKeyPoses6D->points[i].x     = cloudKeyPoses3D->points[i].x;
-        cloudKeyPoses6D->points[i].y     = cloudKeyPoses3D->points[i].y;
-        cloudKeyPoses6D->points[i].z     = cloudKeyPoses3D->points[i].z;
-        cloudKeyPoses6D->points[i].roll  = isamCurrentEstimate.at<Pose3>(poseIndex).rotation().roll();
-        cloudKeyPoses6D->points[i].pitch = isamCurrentEstimate.at<Pose3>(poseIndex).rotation().pitch();
-        cloudKeyPoses6D->points[i].yaw   = isamCurrentEstimate.at<Pose3>(poseIndex).rotation().yaw();
-
-        updatePath(cloudKeyPoses6D->points[i]);
+        Pose3 pose               = isamCurrentEstimate.at<Pose3>(keyPoseIndices[i]);
+        PointTypePose thisPose6D = cloudKeyPoses6D->points[i];
+        thisPose6D.x             = pose.translation().x();
+        thisPose6D.y             = pose.translation().y();
+        thisPose6D.z             = pose.translation().z();
+        thisPose6D.roll          = pose.rotation().roll();
+        thisPose6D.pitch         = pose.rotation().pitch();
+        thisPose6D.yaw           = pose.rotation().yaw();
+
+        // only the key frames that moved beyond the tolerances are updated and
+        // transformed again; the others keep their poses and cached clouds. The
+        // rotation is compared through the relative transform, whose angles are
+        // within [-pi, pi] (a yaw crossing +-pi is a small change)
+        const PointTypePose& lastPose6D = cloudKeyPoses6D->points[i];
+        Eigen::Affine3f transBetween    = pclPointToAffine3f(lastPose6D).inverse() * pclPointToAffine3f(thisPose6D);
+        float x, y, z, roll, pitch, yaw;
+        pcl::getTranslationAndEulerAngles(transBetween, x, y, z, roll, pitch, yaw);
+        if (fabs(thisPose6D.x - lastPose6D.x) <= keyFrameTranslationTolerance &&
+            fabs(thisPose6D.y - lastPose6D.y) <= keyFrameTranslationTolerance &&
+            fabs(thisPose6D.z - lastPose6D.z) <= keyFrameTranslationTolerance &&
+            fabs(roll) <= keyFrameRotationTolerance &&
+            fabs(pitch) <= keyFrameRotationTolerance &&
+            fabs(yaw) <= keyFrameRotationTolerance)
+          continue;
+
+        invalidateKeyFrame(i);
+
+        keyPoseIndex.remove(cloudKeyPoses3D->points[i]);
+        cloudKeyPoses3D->points[i].x = thisPose6D.x;
+        cloudKeyPoses3D->points[i].y = thisPose6D.y;
+        cloudKeyPoses3D->points[i].z = thisPose6D.z;
+        cloudKeyPoses6D->points[i]   = thisPose6D;
+        keyPoseIndex.insert(cloudKeyPoses3D->points[i]);
+
+        // update path in place
+        globalPath.poses[i] = pclPointToPoseStamped(thisPose6D);
       }
 
       aLoopIsClosed = false;
     }
   }
 
-  void updatePath(const PointTypePose& pose_in) {
+  geometry_msgs::PoseStamped pclPointToPoseStamped(const PointTypePose& pose_in) {
     geometry_msgs::PoseStamped pose_stamped;
     pose_stamped.header.stamp       = ros::Time().fromSec(pose_in.time);
     pose_stamped.header.frame_id    = odometryFrame;
@@ -2479,8 +2826,11 @@ class mapOptimization : public ParamServer {
     pose_stamped.pose.orientation.y = q.y();
     pose_stamped.pose.orientation.z = q.z();
     pose_stamped.pose.orientation.w = q.w();
+    return pose_stamped;
+  }
 
-    globalPath.poses.push_back(pose_stamped);
+  void updatePath(const PointTypePose& pose_in) {
+    globalPath.poses.push_back(pclPointToPoseStamped(pose_in));
   }
 
   void publishOdometry() {
@@ -2556,6 +2906,10 @@ class mapOptimization : public ParamServer {
     // publish key poses
     publishCloud(&pubKeyPoses, cloudKeyPoses3D, timeLaserInfoStamp, odometryFrame);
     // Publish surrounding key frames
+    if (mappingBackend != MapBackendType::KDTREE && pubRecentKeyFrames.getNumSubscribers() != 0) {
+      laserCloudSurfFromMapDS->clear();
+      voxelMapSurfFromMap.flatten(*laserCloudSurfFromMapDS);
+    }
     publishCloud(&pubRecentKeyFrames, laserCloudSurfFromMapDS, timeLaserInfoStamp, odometryFrame);
     // publish registered key frame
     if (pubRecentKeyFrame.getNumSubscribers() != 0) {
@@ -2568,7 +2922,7 @@ class mapOptimization : public ParamServer {
     // publish registered high-res raw cloud
     if (pubCloudRegisteredRaw.getNumSubscribers() != 0) {
       pcl::PointCloud<PointType>::Ptr cloudOut(new pcl::PointCloud<PointType>());
-      pcl::fromROSMsg(cloudInfo.cloud_deskewed, *cloudOut);
+      readDeskewedCloud(cloudInfo, cloudOut.get());
       PointTypePose thisPose6D = trans2PointTypePose(transformTobeMapped);
       *cloudOut                = *transformPointCloud(cloudOut, &thisPose6D);
       publishCloud(&pubCloudRegisteredRaw, cloudOut, timeLaserInfoStamp, odometryFrame);
@@ -2585,7 +2939,13 @@ class mapOptimization : public ParamServer {
     }
     if (pubLaserCloudDeskewed.getNumSubscribers() != 0) {
       cloudInfo.header.stamp = timeLaserInfoStamp;
-      pubLaserCloudDeskewed.publish(cloudInfo.cloud_deskewed);
+      if (cloudInfo.version >= packedCloudVersion) {
+        pcl::PointCloud<PointType>::Ptr cloudOut(new pcl::PointCloud<PointType>());
+        unpackCloud(cloudInfo.cloud_deskewed_packed, cloudOut.get());
+        publishCloud(&pubLaserCloudDeskewed, cloudOut, timeLaserInfoStamp, lidarFrame);
+      } else {
+        pubLaserCloudDeskewed.publish(cloudInfo.cloud_deskewed);
+      }
     }
     // public dynamic objects
     if (detectionIsActive) {
@@ -2781,12 +3141,19 @@ class mapOptimization : public ParamServer {
     }
 
     lio_segmot::Diagnosis diagnosis;
-    diagnosis.header.frame_id               = odometryFrame;
-    diagnosis.header.stamp                  = timeLaserInfoStamp;
-    diagnosis.numberOfDetections            = detections ? detections->boxes.size() : 0;
-    diagnosis.computationalTime             = timer.elapsed();
-    diagnosis.numberOfTightlyCoupledObjects = numberOfTightlyCoupledObjectsAtThisMoment;
+    diagnosis.header.frame_id                = odometryFrame;
+    diagnosis.header.stamp                   = timeLaserInfoStamp;
+    diagnosis.numberOfDetections             = detections ? detections->boxes.size() : 0;
+    diagnosis.computationalTime              = timer.elapsed();
+    diagnosis.numberOfTightlyCoupledObjects  = numberOfTightlyCoupledObjectsAtThisMoment;
+    diagnosis.numberOfKeyFrameCacheHits      = laserCloudMapContainer.hits();
+    diagnosis.numberOfKeyFrameCacheMisses    = laserCloudMapContainer.misses();
+    diagnosis.keyFrameCacheSize              = laserCloudMapContainer.bytes() / (1024.0 * 1024.0);
+    diagnosis.numberOfIterations             = numberOfIterations;
+    diagnosis.numberOfCorrespondenceSearches = numberOfCorrespondenceSearches;
+    diagnosis.scanToMapTime                  = scanToMapTime;
     pubDiagnosis.publish(diagnosis);
+    laserCloudMapContainer.resetStatistics();
   }
 };
 
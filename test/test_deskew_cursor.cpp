@@ -0,0 +1,119 @@
+#include "deskewcursor.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace {
+
+/** The linear scan from index 0 that findRotation() used before the cursor */
+int linearImuPointer(const double* imuTime, int last, double pointTime) {
+  int front = 0;
+  while (front < last) {
+    if (pointTime < imuTime[front])
+      break;
+    ++front;
+  }
+  return front;
+}
+
+/** IMU sample times of a 0.1 s sweep at about 400 Hz, with repeated stamps */
+std::vector<double> makeImuTime(std::mt19937* rng) {
+  std::uniform_real_distribution<double> jitter(0.0, 0.005);
+  std::vector<double> imuTime;
+  double time = -0.01;
+  while (time < 0.11) {
+    imuTime.push_back(time);
+    if (imuTime.size() % 7 != 0)
+      time += jitter(*rng);
+  }
+  return imuTime;
+}
+
+/** Point times of a sweep read column by column like an Ouster OS1-128, with some out-of-order points */
+std::vector<double> makePointTime(std::mt19937* rng, int rows, int cols) {
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  std::vector<double> pointTime;
+  pointTime.reserve(rows * cols);
+  for (int j = 0; j < cols; ++j) {
+    for (int i = 0; i < rows; ++i) {
+      if (uniform(*rng) < 0.001)
+        pointTime.push_back(-0.02 + 0.14 * uniform(*rng));  // anywhere in (and out of) the sweep
+      else
+        pointTime.push_back(0.1 * j / cols);
+    }
+  }
+  return pointTime;
+}
+
+}  // namespace
+
+TEST(DeskewCursor, MatchesLinearScan) {
+  std::mt19937 rng(42);
+  for (int trial = 0; trial < 20; ++trial) {
+    std::vector<double> imuTime   = makeImuTime(&rng);
+    std::vector<double> pointTime = makePointTime(&rng, 16, 512);
+    int last                      = imuTime.size();
+
+    DeskewCursor cursor;
+    for (double time : pointTime) {
+      cursor.imuPointer = findImuPointer(imuTime.data(), last, time, cursor.imuPointer);
+      ASSERT_EQ(linearImuPointer(imuTime.data(), last, time), cursor.imuPointer) << "time " << time;
+    }
+
+    // exactly on the IMU stamps, before the first and after the last one
+    for (int k = 0; k < last; ++k) {
+      EXPECT_EQ(linearImuPointer(imuTime.data(), last, imuTime[k]), findImuPointer(imuTime.data(), last, imuTime[k], last - 1 - k));
+      EXPECT_EQ(linearImuPointer(imuTime.data(), last, imuTime[k]), findImuPointer(imuTime.data(), last, imuTime[k], k));
+    }
+    EXPECT_EQ(0, findImuPointer(imuTime.data(), last, imuTime.front() - 1.0, last / 2));
+    EXPECT_EQ(last, findImuPointer(imuTime.data(), last, imuTime.back() + 1.0, last / 2));
+  }
+}
+
+TEST(DeskewCursor, StartOutOfRange) {
+  std::vector<double> imuTime = {0.0, 0.01, 0.02, 0.03};
+  EXPECT_EQ(2, findImuPointer(imuTime.data(), 4, 0.015, 10));
+  EXPECT_EQ(2, findImuPointer(imuTime.data(), 4, 0.015, -3));
+  EXPECT_EQ(0, findImuPointer(imuTime.data(), 0, 0.015, 2));
+}
+
+/** Per-scan lookup time of an OS1-128 sweep, reported rather than asserted */
+TEST(DeskewCursor, Benchmark) {
+  const int rows = 128, cols = 2048, scans = 20;
+  std::mt19937 rng(7);
+  std::vector<double> imuTime   = makeImuTime(&rng);
+  std::vector<double> pointTime = makePointTime(&rng, rows, cols);
+  int last                      = imuTime.size();
+
+  long linearSum = 0, cursorSum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int s = 0; s < scans; ++s)
+    for (double time : pointTime)
+      linearSum += linearImuPointer(imuTime.data(), last, time);
+  double linearTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / scans;
+
+  start = std::chrono::steady_clock::now();
+  for (int s = 0; s < scans; ++s) {
+    // one cursor per ring, as projectPointCloud() keeps one per thread
+    for (int i = 0; i < rows; ++i) {
+      DeskewCursor cursor;
+      for (int j = 0; j < cols; ++j) {
+        cursor.imuPointer = findImuPointer(imuTime.data(), last, pointTime[j * rows + i], cursor.imuPointer);
+        cursorSum += cursor.imuPointer;
+      }
+    }
+  }
+  double cursorTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / scans;
+
+  EXPECT_EQ(linearSum, cursorSum);
+  std::printf("IMU lookup of a %dx%d scan (%d IMU samples): linear scan %.3f ms, cursor %.3f ms\n", rows, cols, last, linearTime, cursorTime);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
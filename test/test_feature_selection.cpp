@@ -0,0 +1,214 @@
+#include "featureselector.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <vector>
+
+namespace {
+
+/**
+ * Synthetic deskewed rings, laid out as imageProjection extracts them: flat stretches and
+ * ranges rounded to 1 cm (tied curvatures), range jumps (occluded points), gaps of more than
+ * 10 columns (column breaks) and missing points. Each point is tagged with its index in x.
+ */
+void makeRings(FeatureSelector* fe, std::mt19937* rng) {
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  lio_segmot::cloud_info& info = fe->cloudInfo;
+  info.startRingIndex.assign(fe->N_SCAN, 0);
+  info.endRingIndex.assign(fe->N_SCAN, 0);
+  info.pointRange.clear();
+  info.pointColInd.clear();
+  fe->extractedCloud->clear();
+
+  int count = 0;
+  for (int i = 0; i < fe->N_SCAN; ++i) {
+    info.startRingIndex[i] = count - 1 + 5;
+
+    float range = 5 + 20 * uniform(*rng);
+    float slope = 0;
+    for (int j = 0; j < fe->Horizon_SCAN; ++j) {
+      float dice = uniform(*rng);
+      if (dice < 0.002f)
+        j += 11 + int(20 * uniform(*rng));  // column break
+      else if (dice < 0.05f)
+        continue;  // no return
+      if (j >= fe->Horizon_SCAN)
+        break;
+
+      dice = uniform(*rng);
+      if (dice < 0.01f)
+        range = 2 + 40 * uniform(*rng);  // occlusion
+      else if (dice < 0.03f)
+        slope = uniform(*rng) < 0.5f ? 0 : (uniform(*rng) - 0.5f) * 0.1f;
+      range = std::max(1.0f, range + slope);
+
+      float noisy = range;
+      if (uniform(*rng) < 0.2f)
+        noisy += (uniform(*rng) - 0.5f) * 0.3f;
+      noisy = std::round(noisy * 100) / 100;
+
+      PointType point;
+      point.x         = count;
+      point.y         = i;
+      point.z         = j;
+      point.intensity = noisy;
+      fe->extractedCloud->push_back(point);
+      info.pointRange.push_back(noisy);
+      info.pointColInd.push_back(j);
+      ++count;
+    }
+
+    info.endRingIndex[i] = count - 1 - 5;
+  }
+}
+
+/**
+ * Suppress the neighbours of a picked feature, as markNeighborsPicked(). A surface at the start of
+ * the first ring would reach before the first point: the old loops read out of bounds there.
+ */
+void markNeighbors(const lio_segmot::cloud_info& info, int ind, std::vector<uint8_t>* neighborPicked) {
+  for (int l = 1; l <= 5; l++) {
+    int columnDiff = std::abs(int(info.pointColInd[ind + l] - info.pointColInd[ind + l - 1]));
+    if (columnDiff > 10)
+      break;
+    (*neighborPicked)[ind + l] = 1;
+  }
+  for (int l = -1; l >= -5 && ind + l >= 0; l--) {
+    int columnDiff = std::abs(int(info.pointColInd[ind + l] - info.pointColInd[ind + l + 1]));
+    if (columnDiff > 10)
+      break;
+    (*neighborPicked)[ind + l] = 1;
+  }
+}
+
+/**
+ * Feature selection the way extractFeatures() did it before the heap and surfacePicked(): each
+ * sub-region sorted by curvature, then walked down for the edges and up for the surfaces.
+ * std::stable_sort keeps tied points in index order, which std::sort left unspecified.
+ */
+void referenceFeatures(const FeatureSelector& fe, std::vector<uint8_t> neighborPicked, pcl::PointCloud<PointType>* cornerCloud, std::vector<pcl::PointCloud<PointType>>* surfaceCloudScans) {
+  const lio_segmot::cloud_info& info  = fe.cloudInfo;
+  const std::vector<float>& curvature = fe.features.curvature;
+  int cloudSize                       = fe.extractedCloud->size();
+
+  std::vector<smoothness_t> cloudSmoothness(cloudSize);
+  for (int i = 0; i < cloudSize; i++)
+    cloudSmoothness[i] = {curvature[i], size_t(i)};
+  std::vector<int> label(cloudSize, 0);
+
+  cornerCloud->clear();
+  surfaceCloudScans->assign(fe.N_SCAN, pcl::PointCloud<PointType>());
+  for (int i = 0; i < fe.N_SCAN; i++) {
+    for (int j = 0; j < 6; j++) {
+      int sp = (info.startRingIndex[i] * (6 - j) + info.endRingIndex[i] * j) / 6;
+      int ep = (info.startRingIndex[i] * (5 - j) + info.endRingIndex[i] * (j + 1)) / 6 - 1;
+
+      if (sp >= ep)
+        continue;
+
+      std::stable_sort(cloudSmoothness.begin() + sp, cloudSmoothness.begin() + ep, [](const smoothness_t& left, const smoothness_t& right) {
+        return left.value < right.value;
+      });
+
+      int largestPickedNum = 0;
+      for (int k = ep; k >= sp; k--) {
+        int ind = cloudSmoothness[k].ind;
+        if (neighborPicked[ind] == 0 && curvature[ind] > fe.edgeThreshold) {
+          largestPickedNum++;
+          if (largestPickedNum <= 20) {
+            label[ind] = 1;
+            cornerCloud->push_back(fe.extractedCloud->points[ind]);
+          } else {
+            break;
+          }
+
+          neighborPicked[ind] = 1;
+          markNeighbors(info, ind, &neighborPicked);
+        }
+      }
+
+      for (int k = sp; k <= ep; k++) {
+        int ind = cloudSmoothness[k].ind;
+        if (neighborPicked[ind] == 0 && curvature[ind] < fe.surfThreshold) {
+          label[ind]          = -1;
+          neighborPicked[ind] = 1;
+          markNeighbors(info, ind, &neighborPicked);
+        }
+      }
+
+      for (int k = sp; k <= ep; k++) {
+        if (label[k] <= 0)
+          (*surfaceCloudScans)[i].push_back(fe.extractedCloud->points[k]);
+      }
+    }
+  }
+}
+
+/** Point indices of a cloud of tagged points */
+std::vector<int> pointIndices(const pcl::PointCloud<PointType>& cloud) {
+  std::vector<int> indices;
+  for (const PointType& point : cloud.points)
+    indices.push_back(int(point.x));
+  return indices;
+}
+
+std::vector<float> pointValues(const pcl::PointCloud<PointType>& cloud) {
+  std::vector<float> values;
+  for (const PointType& point : cloud.points) {
+    values.push_back(point.x);
+    values.push_back(point.y);
+    values.push_back(point.z);
+    values.push_back(point.intensity);
+  }
+  return values;
+}
+
+}  // namespace
+
+class FeatureSelection : public ::testing::TestWithParam<int> {};
+
+TEST_P(FeatureSelection, MatchesSortedSelection) {
+  FeatureSelector fe;
+  fe.N_SCAN               = 64;
+  fe.Horizon_SCAN         = 1800;
+  fe.edgeThreshold        = 1.0;
+  fe.surfThreshold        = 0.1;
+  fe.odometrySurfLeafSize = 0.4;
+  fe.numberOfCores        = GetParam();
+  fe.allocateMemory();
+
+  std::mt19937 rng(7);
+  size_t corners = 0;
+  for (int scan = 0; scan < 10; ++scan) {
+    makeRings(&fe, &rng);
+    fe.calculateSmoothness();
+
+    pcl::PointCloud<PointType> cornerCloud;
+    std::vector<pcl::PointCloud<PointType>> surfaceCloudScans;
+    referenceFeatures(fe, fe.features.neighborPicked, &cornerCloud, &surfaceCloudScans);
+
+    fe.extractFeatures();
+
+    ASSERT_EQ(pointIndices(cornerCloud), pointIndices(*fe.cornerCloud)) << "scan " << scan;
+    pcl::PointCloud<PointType> surfaceCloud, surfaceCloudDS;
+    RingVoxelFilter<PointType> downSizeFilter;
+    downSizeFilter.setLeafSize(fe.odometrySurfLeafSize);
+    for (int i = 0; i < fe.N_SCAN; ++i) {
+      ASSERT_EQ(pointIndices(surfaceCloudScans[i]), pointIndices(*fe.ringFeatures[i].surfaceCloudScan)) << "scan " << scan << " ring " << i;
+      downSizeFilter.filter(surfaceCloudScans[i], &surfaceCloudDS);
+      surfaceCloud += surfaceCloudDS;
+    }
+    ASSERT_EQ(pointValues(surfaceCloud), pointValues(*fe.surfaceCloud)) << "scan " << scan;
+    corners += cornerCloud.size();
+  }
+  // the rings do have edges to select
+  EXPECT_GT(corners, 10000u);
+}
+
+INSTANTIATE_TEST_CASE_P(Threads, FeatureSelection, ::testing::Values(1, 4));
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,152 @@
+#include "ringvoxelfilter.h"
+
+#include <gtest/gtest.h>
+#include <pcl/filters/voxel_grid.h>
+#include <pcl/point_types.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <tuple>
+
+typedef pcl::PointXYZI PointType;
+
+namespace {
+
+// odometrySurfLeafSize of the configurations (outdoor)
+const float leafSize = 0.4f;
+
+/** Points of one lidar ring in scan order: walls at random ranges, range noise and missing returns */
+pcl::PointCloud<PointType>::Ptr makeRing(std::mt19937* rng, int columns) {
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  pcl::PointCloud<PointType>::Ptr ring(new pcl::PointCloud<PointType>());
+  float elevation = (uniform(*rng) - 0.5f) * 0.5f;
+  float range     = 5 + 30 * uniform(*rng);
+  for (int j = 0; j < columns; ++j) {
+    if (uniform(*rng) < 0.3f)
+      continue;
+    if (uniform(*rng) < 0.01f)
+      range = 3 + 40 * uniform(*rng);
+    range += (uniform(*rng) - 0.5f) * 0.05f;
+
+    float azimuth = 2 * M_PI * j / columns;
+    PointType point;
+    point.x         = range * std::cos(elevation) * std::cos(azimuth);
+    point.y         = range * std::cos(elevation) * std::sin(azimuth);
+    point.z         = range * std::sin(elevation);
+    point.intensity = 100 * uniform(*rng);
+    ring->push_back(point);
+  }
+  return ring;
+}
+
+typedef std::tuple<int, int, int> VoxelKey;
+
+/** Centroids by voxel (a centroid lies in the voxel of its points) */
+std::map<VoxelKey, PointType> centroidsByVoxel(const pcl::PointCloud<PointType>& cloud) {
+  std::map<VoxelKey, PointType> centroids;
+  for (const PointType& point : cloud.points) {
+    VoxelKey key(int(std::floor(point.x / leafSize)), int(std::floor(point.y / leafSize)), int(std::floor(point.z / leafSize)));
+    EXPECT_TRUE(centroids.emplace(key, point).second) << "two centroids in one voxel";
+  }
+  return centroids;
+}
+
+}  // namespace
+
+TEST(RingVoxelFilter, MatchesVoxelGrid) {
+  std::mt19937 rng(3);
+  RingVoxelFilter<PointType> ringFilter;
+  ringFilter.setLeafSize(leafSize);
+  pcl::VoxelGrid<PointType> voxelGrid;
+  voxelGrid.setLeafSize(leafSize, leafSize, leafSize);
+
+  size_t voxels = 0;
+  for (int i = 0; i < 500; ++i) {
+    pcl::PointCloud<PointType>::Ptr ring = makeRing(&rng, 1800);
+    pcl::PointCloud<PointType> expected, actual;
+    voxelGrid.setInputCloud(ring);
+    voxelGrid.filter(expected);
+    ringFilter.filter(*ring, &actual);
+
+    // the same centroids, in another order (and summed in another order)
+    ASSERT_EQ(expected.size(), actual.size()) << "ring " << i;
+    std::map<VoxelKey, PointType> expectedCentroids = centroidsByVoxel(expected);
+    std::map<VoxelKey, PointType> actualCentroids   = centroidsByVoxel(actual);
+    for (const auto& voxel : expectedCentroids) {
+      auto match = actualCentroids.find(voxel.first);
+      ASSERT_TRUE(match != actualCentroids.end()) << "ring " << i;
+      EXPECT_NEAR(voxel.second.x, match->second.x, 1e-4);
+      EXPECT_NEAR(voxel.second.y, match->second.y, 1e-4);
+      EXPECT_NEAR(voxel.second.z, match->second.z, 1e-4);
+      EXPECT_NEAR(voxel.second.intensity, match->second.intensity, 1e-3);
+    }
+    voxels += actual.size();
+  }
+  EXPECT_GT(voxels, 100000u);
+}
+
+TEST(RingVoxelFilter, EmptyAndNonFinite) {
+  RingVoxelFilter<PointType> ringFilter;
+  ringFilter.setLeafSize(leafSize);
+  pcl::PointCloud<PointType> input, output;
+  ringFilter.filter(input, &output);
+  EXPECT_EQ(0u, output.size());
+
+  PointType point;
+  point.x         = NAN;
+  point.y         = 1;
+  point.z         = 1;
+  point.intensity = 1;
+  input.push_back(point);
+  point.x = 1;
+  input.push_back(point);
+  ringFilter.filter(input, &output);
+  ASSERT_EQ(1u, output.size());
+  EXPECT_EQ(1, output.points[0].x);
+}
+
+/** Per-scan downsampling time of 64 rings of 1800 columns, reported rather than asserted */
+TEST(RingVoxelFilter, Benchmark) {
+  const int rings = 64, scans = 20;
+  std::mt19937 rng(5);
+  std::vector<pcl::PointCloud<PointType>::Ptr> scan;
+  for (int i = 0; i < rings; ++i)
+    scan.push_back(makeRing(&rng, 1800));
+
+  RingVoxelFilter<PointType> ringFilter;
+  ringFilter.setLeafSize(leafSize);
+  pcl::VoxelGrid<PointType> voxelGrid;
+  voxelGrid.setLeafSize(leafSize, leafSize, leafSize);
+  pcl::PointCloud<PointType> output;
+
+  size_t voxelGridSize = 0, ringFilterSize = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int s = 0; s < scans; ++s) {
+    for (const auto& ring : scan) {
+      voxelGrid.setInputCloud(ring);
+      voxelGrid.filter(output);
+      voxelGridSize += output.size();
+    }
+  }
+  double voxelGridTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / scans;
+
+  start = std::chrono::steady_clock::now();
+  for (int s = 0; s < scans; ++s) {
+    for (const auto& ring : scan) {
+      ringFilter.filter(*ring, &output);
+      ringFilterSize += output.size();
+    }
+  }
+  double ringFilterTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / scans;
+
+  EXPECT_EQ(voxelGridSize, ringFilterSize);
+  std::printf("Downsampling %d rings at %.1f m: pcl::VoxelGrid %.3f ms, RingVoxelFilter %.3f ms per scan\n", rings, leafSize, voxelGridTime, ringFilterTime);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}